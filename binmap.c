@@ -0,0 +1,460 @@
+#include "mindthemap.h"
+
+/*
+ * Binary map format, all integers little-endian:
+ *
+ *	header	magic[4] "MTMB", version[4], nnodes[4], strsize[4]
+ *	nodes	nnodes records of RECSIZE bytes, in preorder:
+ *		parent[4] (index, -1 for the root), nchildren[4],
+ *		x[4], y[4], manual_pos[4], text[4] (offset into strings),
+ *		end[4] (index just past the node's last descendant)
+ *	strings	strsize bytes of NUL-terminated node text
+ *
+ * Parents always precede their children, so the tree can be
+ * rebuilt in one pass over the record array.  The end field,
+ * new in version 2, lets a reader step over whole subtrees and
+ * so read them in only when they are wanted; version 1 maps
+ * lack it and are always read in full.
+ */
+enum {
+	BINVERSION = 2,
+	HDRSIZE = 16,
+	RECSIZE1 = 24,
+	RECSIZE = 28
+};
+
+static char binmagic[4] = "MTMB";
+
+#define REC(lm, i)	((lm)->recs + (i)*RECSIZE)
+
+static void
+put32(uchar *p, ulong v)
+{
+	p[0] = v;
+	p[1] = v>>8;
+	p[2] = v>>16;
+	p[3] = v>>24;
+}
+
+static ulong
+get32(uchar *p)
+{
+	return p[0] | p[1]<<8 | p[2]<<16 | (ulong)p[3]<<24;
+}
+
+/* Fill in a node from its record; the layout works out its bounds */
+static void
+recnode(Node *node, uchar *r)
+{
+	node->pos.x = get32(r+8);
+	node->pos.y = get32(r+12);
+	node->manual_pos = get32(r+16);
+}
+
+/* Number of children a node of pool has, counting those not yet read in */
+int
+nodechildren(Nodepool *pool, Node *node)
+{
+	if(node->stub)
+		return get32(REC(pool->lazy, node->src)+4);
+	return node->nchildren;
+}
+
+/* Count nodes and string table bytes in a subtree */
+static void
+bincount(Nodepool *pool, Node *node, ulong *nnodes, ulong *strsize)
+{
+	Treewalk w;
+	ulong i, end;
+	Lazymap *lm;
+	Node *n;
+
+	lm = pool->lazy;
+
+	walkstart(&w, node);
+	while((n = walkstep(&w)) != nil) {
+		if(w.leaving)
+			continue;
+		*nnodes += 1;
+		*strsize += strlen(n->text) + 1;
+		if(n->stub) {
+			end = get32(REC(lm, n->src)+24);
+			for(i = n->src+1; i < end; i++) {
+				*nnodes += 1;
+				*strsize += strlen(lm->strs + get32(REC(lm, i)+20)) + 1;
+			}
+		}
+	}
+}
+
+/*
+ * Lay out the records of a subtree in preorder.  A node's subtree
+ * end is only known once the walk leaves it, so the records of the
+ * nodes above are kept on a stack by depth until then.  Returns -1
+ * if there is no memory for the stack.
+ */
+static int
+binrecords(uchar *recs, Nodepool *pool, Node *node)
+{
+	Treewalk w;
+	uchar *rec, *r;
+	ulong self, i, end, delta, index, off, *path, *p;
+	int cap;
+	Lazymap *lm;
+	Node *n;
+
+	lm = pool->lazy;
+	cap = 64;
+	path = malloc(cap*sizeof(path[0]));
+	if(path == nil) {
+		werrstr("out of memory");
+		return -1;
+	}
+	index = off = 0;
+	walkstart(&w, node);
+	while((n = walkstep(&w)) != nil) {
+		if(w.leaving) {
+			put32(recs + path[w.depth]*RECSIZE + 24, index);
+			continue;
+		}
+		if(w.depth == cap) {
+			if((p = realloc(path, 2*cap*sizeof(path[0]))) == nil) {
+				free(path);
+				werrstr("out of memory");
+				return -1;
+			}
+			path = p;
+			cap *= 2;
+		}
+		self = index++;
+		path[w.depth] = self;
+		rec = recs + self*RECSIZE;
+		put32(rec+0, w.depth == 0 ? -1 : path[w.depth-1]);
+		put32(rec+4, nodechildren(pool, n));
+		put32(rec+8, n->pos.x);
+		put32(rec+12, n->pos.y);
+		put32(rec+16, n->manual_pos);
+		put32(rec+20, off);
+		off += strlen(n->text) + 1;
+
+		if(n->stub) {
+			/* Copy the unread part straight across, renumbered */
+			end = get32(REC(lm, n->src)+24);
+			delta = self - n->src;
+			for(i = n->src+1; i < end; i++) {
+				r = recs + index++ * RECSIZE;
+				memmove(r, REC(lm, i), RECSIZE);
+				put32(r+0, get32(r+0) + delta);
+				put32(r+20, off);
+				put32(r+24, get32(r+24) + delta);
+				off += strlen(lm->strs + get32(REC(lm, i)+20)) + 1;
+			}
+		}
+	}
+	free(path);
+	return 0;
+}
+
+/*
+ * Write the string table of a subtree in the same order as its
+ * records, counting the nodes off in pool->nwritten as it goes.
+ */
+static int
+binstrings(Biobuf *bp, Nodepool *pool, Node *node)
+{
+	Treewalk w;
+	char *s;
+	ulong i, end;
+	long n;
+	Lazymap *lm;
+	Node *c;
+
+	lm = pool->lazy;
+	walkstart(&w, node);
+	while((c = walkstep(&w)) != nil) {
+		if(w.leaving)
+			continue;
+		n = strlen(c->text) + 1;
+		if(Bwrite(bp, c->text, n) != n)
+			return -1;
+		pool->nwritten++;
+
+		if(c->stub) {
+			end = get32(REC(lm, c->src)+24);
+			for(i = c->src+1; i < end; i++) {
+				s = lm->strs + get32(REC(lm, i)+20);
+				n = strlen(s) + 1;
+				if(Bwrite(bp, s, n) != n)
+					return -1;
+				pool->nwritten++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Save a map held in pool in binary form */
+int
+savebin(Biobuf *bp, Nodepool *pool, Node *root)
+{
+	uchar hdr[HDRSIZE], *recs;
+	ulong nnodes, strsize;
+	long n;
+
+	if(root == nil)
+		return 0;
+
+	nnodes = strsize = 0;
+	bincount(pool, root, &nnodes, &strsize);
+
+	memmove(hdr, binmagic, 4);
+	put32(hdr+4, BINVERSION);
+	put32(hdr+8, nnodes);
+	put32(hdr+12, strsize);
+	if(Bwrite(bp, hdr, HDRSIZE) != HDRSIZE)
+		return -1;
+
+	/* Subtree ends are only known afterwards, so build the records in memory */
+	n = nnodes*RECSIZE;
+	recs = malloc(n);
+	if(recs == nil) {
+		werrstr("map too big");
+		return -1;
+	}
+	if(binrecords(recs, pool, root) < 0 || Bwrite(bp, recs, n) != n) {
+		free(recs);
+		return -1;
+	}
+	free(recs);
+
+	return binstrings(bp, pool, root);
+}
+
+/* Write the unread descendants of a stub of pool in text form */
+int
+savestub(Biobuf *bp, Nodepool *pool, Node *node)
+{
+	uchar *r;
+	ulong i, end;
+
+	end = get32(REC(pool->lazy, node->src)+24);
+	for(i = node->src+1; i < end; i++) {
+		r = REC(pool->lazy, i);
+		if(Bprint(bp, "NODE %s %d %d %d %d\n",
+			pool->lazy->strs + get32(r+20),
+			(int)get32(r+8),
+			(int)get32(r+12),
+			(int)get32(r+16),
+			(int)get32(r+4)) < 0)
+			return -1;
+		pool->nwritten++;
+	}
+	return 0;
+}
+
+/* Read in the children of a stub, leaving them as stubs in turn */
+void
+expandnode(Node *node)
+{
+	Node *child;
+	uchar *r;
+	ulong c, end;
+
+	if(node == nil || !node->stub)
+		return;
+
+	node->stub = 0;
+	end = get32(REC(nodepool->lazy, node->src)+24);
+	for(c = node->src+1; c < end; c = get32(r+24)) {
+		r = REC(nodepool->lazy, c);
+		child = createnode(nil, node);
+		child->text = nodepool->lazy->strs + get32(r+20);  /* Shared until edited */
+		recnode(child, r);
+		child->src = c;
+		child->stub = get32(r+4) > 0;
+	}
+}
+
+/* Release a lazily read map */
+void
+freelazy(Lazymap *lm)
+{
+	if(lm == nil)
+		return;
+	free(lm->recs);
+	free(lm->strs);
+	free(lm);
+}
+
+/*
+ * Check that the subtree ends of a version 2 map nest properly,
+ * so that expandnode can later trust them without looking again.
+ */
+static int
+checkends(uchar *recs, ulong nnodes)
+{
+	ulong i, end, pend;
+	int parent;
+
+	for(i = 0; i < nnodes; i++) {
+		parent = get32(recs + i*RECSIZE);
+		end = get32(recs + i*RECSIZE + 24);
+		pend = i == 0 ? nnodes : get32(recs + parent*RECSIZE + 24);
+		if(end <= i || end > pend) {
+			werrstr("corrupt binary map at node %lud", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Bytes left to read in bp, or -1 if it reads a pipe and cannot tell */
+static vlong
+bytesleft(Biobuf *bp)
+{
+	Dir *d;
+	vlong n;
+
+	/* Pipes refuse to seek */
+	if(seek(Bfildes(bp), 0, 1) < 0 || (d = dirfstat(Bfildes(bp))) == nil)
+		return -1;
+	n = d->length - Boffset(bp);
+	free(d);
+	return n;
+}
+
+/*
+ * Load a map in binary form into pool, building the tree in one
+ * linear pass.  If lazy is set and the map records subtree ends,
+ * only the root is built, as a stub; the records are kept as the
+ * pool's lazy map and expandnode reads subtrees in from them as
+ * they are needed.
+ */
+Node*
+loadbin(Biobuf *bp, Nodepool *pool, int lazy)
+{
+	uchar hdr[HDRSIZE], *recs, *r;
+	char *strs;
+	ulong i, version, recsize, nnodes, strsize, off;
+	vlong left;
+	int parent;
+	Node **nodes, *node, *root;
+	Lazymap *lm;
+
+	if(Bread(bp, hdr, HDRSIZE) != HDRSIZE || memcmp(hdr, binmagic, 4) != 0) {
+		werrstr("not a binary map");
+		return nil;
+	}
+	version = get32(hdr+4);
+	if(version != 1 && version != BINVERSION) {
+		werrstr("unknown binary map version %lud", version);
+		return nil;
+	}
+	recsize = version == 1 ? RECSIZE1 : RECSIZE;
+	nnodes = get32(hdr+8);
+	strsize = get32(hdr+12);
+	if(nnodes == 0 || nnodes > 0x7FFFFFFF/RECSIZE) {
+		werrstr("bad node count %lud", nnodes);
+		return nil;
+	}
+	if(strsize > 0x7FFFFFFF) {
+		werrstr("bad string table size %lud", strsize);
+		return nil;
+	}
+
+	/* This runs on the job proc, so a bad header must not take us down */
+	left = bytesleft(bp);
+	if(left >= 0 && (vlong)nnodes*recsize + strsize > left) {
+		werrstr("short binary map");
+		return nil;
+	}
+	root = nil;
+	nodes = nil;
+	recs = malloc(nnodes*recsize);
+	strs = malloc(strsize+1);
+	if(recs == nil || strs == nil) {
+		werrstr("map too big");
+		goto out;
+	}
+
+	if(Bread(bp, recs, nnodes*recsize) != nnodes*recsize
+	|| Bread(bp, strs, strsize) != strsize) {
+		werrstr("short binary map");
+		goto out;
+	}
+	strs[strsize] = '\0';
+
+	for(i = 0; i < nnodes; i++) {
+		r = recs + i*recsize;
+		parent = get32(r+0);
+		off = get32(r+20);
+		if((i == 0 ? parent != -1 : parent < 0 || parent >= i) || off >= strsize) {
+			werrstr("corrupt binary map at node %lud", i);
+			goto out;
+		}
+	}
+	if(version >= 2 && checkends(recs, nnodes) < 0)
+		goto out;
+
+	if(lazy && version >= 2) {
+		lm = malloc(sizeof(Lazymap));
+		if(lm == nil) {
+			werrstr("map too big");
+			goto out;
+		}
+		lm->recs = recs;
+		lm->strs = strs;
+		lm->nnodes = nnodes;
+		lm->strsize = strsize;
+
+		if((root = newnode(pool, nil, nil)) == nil) {
+			free(lm);
+			goto out;
+		}
+		root->text = strs + get32(recs+20);
+		recnode(root, recs);
+		root->src = 0;
+		root->stub = get32(recs+4) > 0;
+		pool->lazy = lm;
+		return root;
+	}
+
+	nodes = malloc(nnodes*sizeof(Node*));
+	if(nodes == nil) {
+		werrstr("map too big");
+		goto out;
+	}
+
+	for(i = 0; i < nnodes; i++) {
+		r = recs + i*recsize;
+		parent = get32(r+0);
+		if((node = newnode(pool, nil, i == 0 ? nil : nodes[parent])) == nil)
+			goto out;
+		node->text = strs + get32(r+20);
+		recnode(node, r);
+		nodes[i] = node;
+	}
+
+	/* The nodes share the string table rather than copy it */
+	if(poolattach(pool, strs) < 0)
+		goto out;
+	root = nodes[0];
+	strs = nil;
+
+out:
+	free(recs);
+	free(strs);
+	free(nodes);
+	return root;
+}
+
+/* Maps named *.mtb are written in binary form */
+int
+binaryname(char *filename)
+{
+	int n;
+
+	n = strlen(filename);
+	return n > 4 && strcmp(filename+n-4, ".mtb") == 0;
+}
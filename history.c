@@ -0,0 +1,388 @@
+#include "mindthemap.h"
+
+/*
+ * Undo and redo.  Each edit made by hand is logged as it is made:
+ * a node added, a subtree deleted, a node's text typed over in one
+ * go in insert mode, a node dragged.  A deleted subtree is not
+ * freed but only unlinked from the map, and the log keeps hold of
+ * it, so undoing the delete of however big a subtree is a matter
+ * of linking its top back in where it was.  An added node that is
+ * undone is kept the same way for redo.
+ *
+ * The log runs oldest first, with the edits done before hcur and
+ * those undone from it on; a new edit drops the undone ones.  It
+ * costs the records themselves, their copies of text, and the nodes
+ * held out of the map.  While that comes to more than histbudget
+ * bytes the oldest edits are forgotten, and any subtree they held
+ * is freed at last.
+ */
+enum {
+	HADD,
+	HDELETE,
+	HTEXT,
+	HMOVE
+};
+
+typedef struct Hist {
+	int op;
+	Node *node;
+	Node *parent;    /* Where node goes back in, for HADD and HDELETE */
+	Node *prev;      /* Sibling it follows, nil if the first */
+	ulong nnodes;    /* In node's subtree, while it is held */
+	ulong gen;       /* Journal numbering it was unlinked under */
+	char *text[2];   /* Before and after, for HTEXT */
+	Point pos[2];    /* Before and after, for HMOVE */
+	uchar manual[2];
+	uchar typed;     /* HADD whose first text has been typed */
+} Hist;
+
+long histbudget = 32*1024*1024;  /* Bytes the log may take */
+
+static Hist *hist;
+static int hlo;     /* Oldest edit remembered */
+static int hcur;    /* Next to redo */
+static int hn;
+static int hcap;
+static long hbytes;
+static Node *tnode;   /* Node being typed into */
+static char *ttext;   /* Its text beforehand */
+static int tadd;      /* Whether this is the text it was added for */
+static Node *gnode;   /* Node grabbed to drag */
+static Point gpos;
+static uchar gmanual;
+
+/* Whether an edit, done or not as done says, holds its node out of the map */
+static int
+held(Hist *h, int done)
+{
+	return (h->op == HDELETE && done) || (h->op == HADD && !done);
+}
+
+/* Bytes an edit costs the log */
+static long
+cost(Hist *h, int done)
+{
+	long n;
+
+	n = sizeof(Hist);
+	if(h->op == HTEXT)
+		n += strlen(h->text[0]) + strlen(h->text[1]) + 2;
+	if(held(h, done))
+		n += h->nnodes * sizeof(Node);
+	return n;
+}
+
+/* Nodes in the subtree under n */
+static ulong
+countnodes(Node *n)
+{
+	Treewalk w;
+	Node *c;
+	ulong k;
+
+	/* The store has it to hand unless the map has changed shape since */
+	if(tree.valid && n->idx < tree.n && tree.node[n->idx] == n)
+		return tree.end[n->idx] - n->idx;
+	k = 0;
+	walkstart(&w, n);
+	while((c = walkstep(&w)) != nil)
+		if(!w.leaving)
+			k++;
+	return k;
+}
+
+/* Let go of an edit, freeing whatever it holds */
+static void
+release(Hist *h, int done)
+{
+	hbytes -= cost(h, done);
+	if(held(h, done))
+		freenode(h->node);
+	if(h->op == HTEXT) {
+		free(h->text[0]);
+		free(h->text[1]);
+	}
+}
+
+/* Forget the edits undone */
+static void
+dropredo(void)
+{
+	while(hn > hcur)
+		release(&hist[--hn], 0);
+}
+
+/* Forget the oldest edits until the log is back within budget */
+static void
+trim(void)
+{
+	while(hbytes > histbudget && hn > hlo) {
+		if(hcur == hlo) {
+			/* Nothing left to undo, and redo must start with the oldest */
+			dropredo();
+			break;
+		}
+		release(&hist[hlo++], 1);
+	}
+	if(hlo == hn)
+		hlo = hcur = hn = 0;
+}
+
+/* Log a new edit, done */
+static Hist*
+push(int op, Node *node)
+{
+	Hist *h;
+
+	dropredo();
+	if(hn == hcap) {
+		if(hlo > 0) {
+			memmove(hist, hist+hlo, (hn-hlo)*sizeof(Hist));
+			hn -= hlo;
+			hcur -= hlo;
+			hlo = 0;
+		} else {
+			hcap = hcap ? 2*hcap : 256;
+			hist = realloc(hist, hcap*sizeof(Hist));
+			if(hist == nil)
+				sysfatal("realloc failed: %r");
+		}
+	}
+	h = &hist[hn++];
+	hcur = hn;
+	memset(h, 0, sizeof(Hist));
+	h->op = op;
+	h->node = node;
+	return h;
+}
+
+/* Note that node n has just been added to the map */
+void
+histadd(Node *n)
+{
+	Hist *h;
+
+	h = push(HADD, n);
+	h->parent = n->parent;
+	h->prev = n->prev;
+	h->nnodes = 1;
+	hbytes += cost(h, 1);
+	trim();
+}
+
+/* Unlink node n and its subtree from the map, holding them */
+void
+histdelete(Node *n)
+{
+	Hist *h;
+
+	h = push(HDELETE, n);
+	h->parent = n->parent;
+	h->prev = n->prev;
+	h->nnodes = countnodes(n);
+	h->gen = journalgen();
+	detachnode(n);
+	hbytes += cost(h, 1);
+	trim();
+}
+
+/* Note that n is about to be typed into */
+void
+histtext(Node *n)
+{
+	Hist *h;
+
+	free(ttext);
+	tnode = n;
+	/* Only the typing that follows on the add belongs to it */
+	tadd = 0;
+	if(hcur == hn && hcur > hlo) {
+		h = &hist[hcur-1];
+		if(h->op == HADD && h->node == n && !h->typed) {
+			h->typed = 1;
+			tadd = 1;
+		}
+	}
+	ttext = strdup(n->text);
+	if(ttext == nil)
+		sysfatal("strdup failed: %r");
+}
+
+/* Log what was typed into the node since histtext */
+void
+histtextdone(void)
+{
+	Hist *h;
+	Node *n;
+
+	if((n = tnode) == nil)
+		return;
+	tnode = nil;
+
+	/* A node's first text is part of adding it */
+	if(strcmp(ttext, n->text) == 0
+	|| (tadd && hcur == hn && hcur > hlo && hist[hcur-1].op == HADD && hist[hcur-1].node == n)) {
+		free(ttext);
+		ttext = nil;
+		return;
+	}
+	h = push(HTEXT, n);
+	h->text[0] = ttext;
+	h->text[1] = strdup(n->text);
+	if(h->text[1] == nil)
+		sysfatal("strdup failed: %r");
+	ttext = nil;
+	hbytes += cost(h, 1);
+	trim();
+}
+
+/* Note that n is about to be dragged */
+void
+histgrab(Node *n)
+{
+	gnode = n;
+	gpos = n->pos;
+	gmanual = n->manual_pos;
+}
+
+/* Log the drag of the node grabbed, returning whether it moved */
+int
+histmove(Node *n)
+{
+	Hist *h;
+
+	if(n != gnode)
+		return 0;
+	gnode = nil;
+	if(eqpt(n->pos, gpos) && n->manual_pos == gmanual)
+		return 0;
+	h = push(HMOVE, n);
+	h->pos[0] = gpos;
+	h->manual[0] = gmanual;
+	h->pos[1] = n->pos;
+	h->manual[1] = n->manual_pos;
+	hbytes += cost(h, 1);
+	trim();
+	return 1;
+}
+
+/* Take a node out of the map again, holding it */
+static void
+takeout(Hist *h)
+{
+	journaldel(h->node);
+	detachnode(h->node);
+	h->gen = journalgen();
+	current = h->parent;
+}
+
+/* Put a node held back where it was */
+static void
+putback(Hist *h)
+{
+	attachnode(h->node, h->parent, h->prev);
+	journalrestore(h->node, h->gen);
+	current = h->node;
+}
+
+/* Make an edit's node as it was before, or after */
+static void
+restore(Hist *h, int after)
+{
+	Node *n;
+
+	n = h->node;
+	if(h->op == HTEXT) {
+		settext(nodepool, n, h->text[after]);
+		journaltext(n);
+	} else {
+		n->pos = h->pos[after];
+		if(n->manual_pos != h->manual[after])
+			layoutreshape();
+		n->manual_pos = h->manual[after];
+		journalmove(n);
+	}
+	markdirty(n);
+	current = n;
+}
+
+/* Undo the last edit, returning -1 if there is none */
+int
+undo(void)
+{
+	Hist *h;
+
+	if(hcur == hlo) {
+		setstatus("nothing to undo");
+		return -1;
+	}
+	h = &hist[--hcur];
+	hbytes += cost(h, 0) - cost(h, 1);
+	damage(current->bounds);
+	switch(h->op) {
+	case HADD:
+		takeout(h);
+		break;
+	case HDELETE:
+		putback(h);
+		break;
+	default:
+		restore(h, 0);
+		break;
+	}
+	damage(current->bounds);
+	trim();
+	return 0;
+}
+
+/* Redo the last edit undone, returning -1 if there is none */
+int
+redo(void)
+{
+	Hist *h;
+
+	if(hcur == hn) {
+		setstatus("nothing to redo");
+		return -1;
+	}
+	h = &hist[hcur++];
+	hbytes += cost(h, 1) - cost(h, 0);
+	damage(current->bounds);
+	switch(h->op) {
+	case HADD:
+		putback(h);
+		break;
+	case HDELETE:
+		takeout(h);
+		break;
+	default:
+		restore(h, 1);
+		break;
+	}
+	damage(current->bounds);
+	trim();
+	return 0;
+}
+
+/*
+ * Forget every edit, as when the map is replaced.  The nodes held
+ * go with the old map's pool, so they are left alone.
+ */
+void
+histclear(void)
+{
+	int i;
+
+	for(i = hlo; i < hn; i++)
+		if(hist[i].op == HTEXT) {
+			free(hist[i].text[0]);
+			free(hist[i].text[1]);
+		}
+	hlo = hcur = hn = 0;
+	hbytes = 0;
+	free(ttext);
+	ttext = nil;
+	tnode = nil;
+	tadd = 0;
+	gnode = nil;
+}
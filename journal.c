@@ -0,0 +1,731 @@
+#include "mindthemap.h"
+
+/*
+ * The journal.  With -j, each edit to the map is appended to
+ * name.jnl as it is made, one short line each, so the map file
+ * itself need only be written out now and then; on startup the
+ * map is read and the journal played over it.  The records:
+ *
+ *	C id parent	new last child of parent, with empty text
+ *	D id	unlink the subtree under id, keeping it
+ *	A id parent prev	link unlinked id back in under parent,
+ *		after sibling prev, or first if prev is -
+ *	T id text	set the text, with newline and backslash
+ *		written as \n and \\
+ *	M id x y	move by hand
+ *	M id	go back to being laid out automatically
+ *	R	ids are positions in preorder from here on
+ *	Z	as R, for a map file new to the journal
+ *	S path	the map file with qid.path path holds the map as
+ *		it was at the last R or Z, or the start if none
+ *
+ * Nodes are named by their position in preorder as of the last
+ * renumbering, with new nodes numbered on from there.  Once the
+ * journal has grown to a fair part of the map file it is compacted:
+ * an R restarts the numbering, the map as it stands is written out
+ * in the background to a file an S names, and once that is in place
+ * the journal is cut down to the records after the R.  The journal
+ * can so be played over either map file should we die in between:
+ * over the old one, the R numbers the nodes as the new file has
+ * them.  A Z ends play over an older file, as what follows was
+ * done to a different map, and the journal is cut short there.
+ *
+ * Deletes are kept, so that undo can link them back in by id.
+ * Once the nodes are numbered afresh an unlinked subtree has no
+ * id left, and undoing its delete writes it out node by node.
+ */
+enum {
+	JMINSIZE = 64*1024  /* Journal always left to grow this far */
+};
+
+static char *mapname;    /* Map file the journal goes with, nil if none */
+static char *jnlname;    /* mapname.jnl */
+static int jfd = -1;     /* Journal being appended to, -1 if none yet */
+static vlong jsize;      /* Bytes in it */
+static vlong mapsize;    /* Bytes in the map file */
+static vlong jmark;      /* Start of the records after the last R or Z */
+static int compacting;   /* Map file being written out */
+static int mapbinary;    /* Whether it is written in binary form */
+static int started;      /* Map file read in, or tried */
+static ulong nextid;     /* Id of the next node made */
+static ulong jgen;       /* Times the nodes have been numbered */
+static Node **ids;       /* Nodes by id, while the journal is played */
+static ulong nids;
+static Node **dead;      /* Subtrees unlinked, while the journal is played */
+static ulong ndead;
+static ulong deadcap;
+
+/* Journal edits to the map in file name */
+void
+journalinit(char *name)
+{
+	mapname = name;
+	mapbinary = binaryname(name);
+	jnlname = smprint("%s.jnl", name);
+	if(jnlname == nil)
+		sysfatal("smprint failed: %r");
+}
+
+/* Whether name is the map file being journaled */
+int
+journaled(char *name)
+{
+	return mapname != nil && strcmp(name, mapname) == 0;
+}
+
+/* Append a record, giving up on the journal if it cannot be written */
+static void
+record(char *fmt, ...)
+{
+	char *s;
+	va_list a;
+	int n;
+
+	if(jfd < 0)
+		return;
+	va_start(a, fmt);
+	s = vsmprint(fmt, a);  /* Text read in may run past MAXTEXT */
+	va_end(a);
+	if(s == nil)
+		sysfatal("smprint failed: %r");
+	n = strlen(s);
+	if(write(jfd, s, n) != n) {
+		setstatus("%s: %r; no longer journaling", jnlname);
+		close(jfd);
+		jfd = -1;
+		mapname = nil;
+	} else
+		jsize += n;
+	free(s);
+}
+
+void
+journaladd(Node *n)
+{
+	if(jfd < 0)
+		return;
+	n->id = nextid++;
+	record("C %lud %lud\n", n->id, n->parent->id);
+}
+
+void
+journaldel(Node *n)
+{
+	record("D %lud\n", n->id);
+}
+
+void
+journaltext(Node *n)
+{
+	char *s, *t, *e;
+
+	if(jfd < 0)
+		return;
+	/* A text read in may hold newlines, which would end the record */
+	e = malloc(2*strlen(n->text)+1);
+	if(e == nil)
+		sysfatal("malloc failed: %r");
+	for(s = n->text, t = e; *s != '\0'; s++) {
+		if(*s == '\n' || *s == '\\') {
+			*t++ = '\\';
+			*t++ = *s == '\n' ? 'n' : '\\';
+		} else
+			*t++ = *s;
+	}
+	*t = '\0';
+	record("T %lud %s\n", n->id, e);
+	free(e);
+}
+
+void
+journalmove(Node *n)
+{
+	if(n->manual_pos)
+		record("M %lud %d %d\n", n->id, n->pos.x, n->pos.y);
+	else
+		record("M %lud\n", n->id);
+}
+
+/* Which numbering of the nodes ids are in, to hand to journalrestore */
+ulong
+journalgen(void)
+{
+	return jgen;
+}
+
+/*
+ * Note that n, unlinked while the nodes were numbered as gen says,
+ * has been linked back in.  If they are numbered the same way still
+ * it is named by its id; if not, it is written out node by node.
+ */
+void
+journalrestore(Node *n, ulong gen)
+{
+	Treewalk w;
+	Node *c;
+
+	if(jfd < 0)
+		return;
+	if(gen != jgen) {
+		walkstart(&w, n);
+		while((c = walkstep(&w)) != nil) {
+			if(w.leaving)
+				continue;
+			c->id = nextid++;
+			record("C %lud %lud\n", c->id, c->parent->id);
+			if(c->text[0] != '\0')
+				journaltext(c);
+			if(c->manual_pos)
+				journalmove(c);
+		}
+		if(n->next == nil)
+			return;
+		/* Made as the last child, it must be moved where it was */
+		record("D %lud\n", n->id);
+	}
+	if(n->prev != nil)
+		record("A %lud %lud %lud\n", n->id, n->parent->id, n->prev->id);
+	else
+		record("A %lud %lud -\n", n->id, n->parent->id);
+}
+
+/* Number the nodes in preorder, noting them by id if table is set */
+static void
+renumber(int table)
+{
+	Treewalk w;
+	Node *n;
+	ulong i;
+
+	i = 0;
+	walkstart(&w, root);
+	while((n = walkstep(&w)) != nil) {
+		if(w.leaving)
+			continue;
+		n->id = i++;
+	}
+	nextid = i;
+	jgen++;
+
+	if(!table)
+		return;
+	free(ids);
+	nids = nextid + nextid/2 + 64;
+	ids = mallocz(nids*sizeof(ids[0]), 1);
+	if(ids == nil)
+		sysfatal("malloc failed: %r");
+	walkstart(&w, root);
+	while((n = walkstep(&w)) != nil)
+		if(!w.leaving)
+			ids[n->id] = n;
+}
+
+static Node*
+byid(char *s)
+{
+	char *e;
+	ulong id;
+
+	id = strtoul(s, &e, 10);
+	if(e == s || id >= nids)
+		return nil;
+	return ids[id];
+}
+
+/* Free the subtrees unlinked in play and never linked back in */
+static void
+freedead(void)
+{
+	ulong i;
+
+	for(i = 0; i < ndead; i++)
+		freenode(dead[i]);
+	ndead = 0;
+}
+
+/* Whether n is in the map, rather than unlinked */
+static int
+linked(Node *n)
+{
+	while(n->parent != nil)
+		n = n->parent;
+	return n == root;
+}
+
+/* Play one record over the map, returning -1 if it makes no sense */
+static int
+play(char *s)
+{
+	Node *n, *c, *p;
+	char *f[4], *r, *t;
+	ulong id, i;
+	int nf;
+
+	if(s[0] == 'T') {
+		/* The text runs to the end of the line, spaces and all */
+		if(s[1] != ' ' || (n = byid(s+2)) == nil || (s = strchr(s+2, ' ')) == nil)
+			return -1;
+		s++;
+		for(r = t = s; *r != '\0'; r++) {
+			if(*r == '\\') {
+				if(r[1] == 'n')
+					*t++ = '\n';
+				else if(r[1] == '\\')
+					*t++ = '\\';
+				else
+					return -1;
+				r++;
+			} else
+				*t++ = *r;
+		}
+		*t = '\0';
+		settext(nodepool, n, s);
+		markdirty(n);
+		return 0;
+	}
+
+	if((nf = tokenize(s, f, nelem(f))) < 1)
+		return -1;
+	switch(f[0][0]) {
+	case 'C':
+		if(nf != 3 || (n = byid(f[2])) == nil)
+			return -1;
+		id = strtoul(f[1], nil, 10);
+		if(id >= nids) {
+			nids = id + id/2 + 64;
+			ids = realloc(ids, nids*sizeof(ids[0]));
+			if(ids == nil)
+				sysfatal("realloc failed: %r");
+			memset(ids+nextid, 0, (nids-nextid)*sizeof(ids[0]));
+		}
+		if(id < nextid || ids[id] != nil)
+			return -1;
+		c = createnode("", n);
+		c->id = id;
+		ids[id] = c;
+		nextid = id+1;
+		break;
+	case 'D':
+		/* Kept by id until the nodes are numbered afresh, in case of an A */
+		if(nf != 2 || (n = byid(f[1])) == nil || n->parent == nil)
+			return -1;
+		detachnode(n);
+		if(ndead == deadcap) {
+			deadcap = deadcap ? 2*deadcap : 64;
+			dead = realloc(dead, deadcap*sizeof(dead[0]));
+			if(dead == nil)
+				sysfatal("realloc failed: %r");
+		}
+		dead[ndead++] = n;
+		break;
+	case 'A':
+		if(nf != 4 || (n = byid(f[1])) == nil || (p = byid(f[2])) == nil)
+			return -1;
+		if(n == root || n->parent != nil || !linked(p))
+			return -1;
+		c = nil;
+		if(strcmp(f[3], "-") != 0 && ((c = byid(f[3])) == nil || c->parent != p))
+			return -1;
+		for(i = 0; i < ndead && dead[i] != n; i++)
+			;
+		if(i == ndead)
+			return -1;
+		dead[i] = dead[--ndead];
+		attachnode(n, p, c);
+		break;
+	case 'M':
+		if((nf != 4 && nf != 2) || (n = byid(f[1])) == nil)
+			return -1;
+		if(n->manual_pos != (nf == 4))
+			layoutreshape();
+		if(nf == 4)
+			n->pos = Pt(atoi(f[2]), atoi(f[3]));
+		n->manual_pos = nf == 4;
+		markdirty(n);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/* Read all of the file open on fd, setting *size to its length */
+static char*
+slurp(int fd, vlong *size)
+{
+	Dir *d;
+	char *buf;
+
+	if((d = dirfstat(fd)) == nil)
+		return nil;
+	*size = d->length;
+	free(d);
+	buf = malloc(*size+1);
+	if(buf == nil)
+		sysfatal("malloc failed: %r");
+	if(readn(fd, buf, *size) != *size) {
+		free(buf);
+		return nil;
+	}
+	buf[*size] = '\0';
+	return buf;
+}
+
+/* Whether the journal has an S record for the file with qid.path path */
+static int
+names(uvlong path)
+{
+	char *buf, *s, *e;
+	vlong size;
+	int fd, found;
+
+	if((fd = open(jnlname, OREAD)) < 0)
+		return 0;
+	buf = slurp(fd, &size);
+	close(fd);
+	if(buf == nil)
+		return 0;
+	found = 0;
+	for(s = buf; s < buf+size; s = e+1) {
+		if((e = strchr(s, '\n')) == nil)
+			break;
+		if(s[0] == 'S' && strtoull(s+1, nil, 10) == path)
+			found = 1;
+	}
+	free(buf);
+	return found;
+}
+
+/*
+ * Put right what dying partway through replacefile leaves: the old
+ * file removed and the new one whole in its .tmp, not yet renamed.
+ * A journal's temp is taken back outright.  A map's is taken only
+ * if the journal names it as a snapshot; the map file is not
+ * removed until its snapshot is written out in full.  Anything
+ * else left where the map file should be is not ours to write
+ * over.  Returns 1 if the map file has been put back, 0 if there
+ * was nothing to do, and -1 if the map is missing but must not be
+ * started afresh.
+ */
+static int
+journalmend(void)
+{
+	char *tmp;
+	Dir *d;
+	int r;
+
+	tmp = smprint("%s.tmp", jnlname);
+	if(tmp == nil)
+		sysfatal("smprint failed: %r");
+	r = 0;
+	if(access(jnlname, AEXIST) == 0)
+		remove(tmp);  /* Left by a cut that died before it was done */
+	else if(access(tmp, AEXIST) == 0)
+		r = replacefile(tmp, jnlname);
+	free(tmp);
+	if(r < 0)
+		return -1;
+
+	if(access(mapname, AEXIST) == 0)
+		return 0;
+	tmp = smprint("%s.tmp", mapname);
+	if(tmp == nil)
+		sysfatal("smprint failed: %r");
+	if((d = dirstat(tmp)) == nil) {
+		free(tmp);
+		if(access(jnlname, AEXIST) == 0) {
+			werrstr("%s is missing but %s is there", mapname, jnlname);
+			return -1;
+		}
+		return 0;  /* A new map */
+	}
+	r = -1;
+	if(!names(d->qid.path))
+		werrstr("%s is missing but %s is there", mapname, tmp);
+	else if(replacefile(tmp, mapname) == 0)
+		r = 1;
+	free(d);
+	free(tmp);
+	return r;
+}
+
+/*
+ * Play the journal over the map just read from mapname and go on
+ * appending to it, or start one if there is none.  Returns the
+ * number of records played, or -1 if the journal is not for this
+ * map file.
+ */
+static int
+journalplay(void)
+{
+	Dir *d, nd;
+	char *buf, *s, *e;
+	vlong size, mark, start, cut;
+	uvlong path;
+	int fd, nplayed, bad;
+
+	if((d = dirstat(mapname)) == nil)
+		return -1;
+	path = d->qid.path;
+	mapsize = d->length;
+	free(d);
+
+	if((fd = open(jnlname, ORDWR)) < 0) {
+		if((fd = create(jnlname, ORDWR|OEXCL, 0666)) < 0)
+			return -1;
+		jfd = fd;
+		jsize = 0;
+		renumber(0);
+		record("S %llud\n", path);
+		return 0;
+	}
+
+	if((buf = slurp(fd, &size)) == nil) {
+		close(fd);
+		return -1;
+	}
+
+	/* A line cut short as we died is dropped, so records can follow */
+	for(e = buf+size; e > buf && e[-1] != '\n'; e--)
+		;
+	if(e < buf+size) {
+		nulldir(&nd);
+		nd.length = e - buf;
+		if(dirfwstat(fd, &nd) < 0) {
+			free(buf);
+			close(fd);
+			return -1;
+		}
+		size = e - buf;
+		buf[size] = '\0';
+	}
+
+	/* Play from the point the last S for this map file records */
+	start = -1;
+	mark = 0;
+	for(s = buf; s < buf+size; s = e+1) {
+		e = strchr(s, '\n');
+		if(s[0] == 'R' || s[0] == 'Z')
+			mark = e+1 - buf;
+		else if(s[0] == 'S' && strtoull(s+1, nil, 10) == path)
+			start = mark;
+	}
+	if(start < 0) {
+		free(buf);
+		close(fd);
+		werrstr("%s is not a journal of this map", jnlname);
+		return -1;
+	}
+
+	renumber(1);
+	nplayed = 0;
+	bad = 0;
+	cut = -1;
+	for(s = buf+start; s < buf+size; s = e+1) {
+		e = strchr(s, '\n');
+		*e = '\0';
+		if(s[0] == 'S')
+			continue;
+		if(s[0] == 'Z') {
+			cut = s - buf;
+			break;
+		}
+		if(s[0] == 'R') {
+			freedead();
+			renumber(1);
+			continue;
+		}
+		if(play(s) < 0) {
+			setstatus("%s: bad record at byte %lld", jnlname, (vlong)(s - buf));
+			bad = 1;
+			break;
+		}
+		nplayed++;
+	}
+	freedead();
+	free(ids);
+	ids = nil;
+	nids = 0;
+	free(buf);
+
+	/*
+	 * What follows a Z was done to a map whose snapshot never made
+	 * it, so can never be played; new records go where it was.
+	 */
+	if(cut >= 0) {
+		nulldir(&nd);
+		nd.length = cut;
+		if(dirfwstat(fd, &nd) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	jfd = fd;
+	jsize = seek(fd, 0, 2);
+	layoutmap(root, 0);
+	damageall();
+
+	/* Records past a bad one can never be played, so start afresh */
+	if(bad)
+		journalcompact(0, -1);
+	return nplayed;
+}
+
+/*
+ * Note that a map has been read in, or failed to be.  The first
+ * is the map file the journal goes with, over which the journal is
+ * played; a new map file is written out to start with, but only if
+ * neither it nor its journal is there.  Any later map read in is
+ * not the one journaled, so journaling stops, leaving the journal
+ * to play over the map file as it stands.
+ */
+void
+journalread(char *name, int ok)
+{
+	int n;
+
+	if(mapname == nil)
+		return;
+	if(started) {
+		if(ok) {
+			setstatus("read %s; no longer journaling %s", name, mapname);
+			if(jfd >= 0)
+				close(jfd);
+			jfd = -1;
+			mapname = nil;
+		}
+		return;
+	}
+	if((n = journalmend()) < 0) {
+		setstatus("%r; not journaling");
+		mapname = nil;
+		return;
+	}
+	if(n > 0 && !ok) {
+		/* The map is back in place, so read it again */
+		loadmap(mapname, 0);
+		return;
+	}
+	started = 1;
+	if(!ok) {
+		if(access(mapname, AEXIST) < 0)
+			journalcompact(1, -1);
+		else
+			mapname = nil;
+		return;
+	}
+	if((n = journalplay()) < 0) {
+		setstatus("%s: %r; not journaling", name);
+		mapname = nil;
+	} else if(n > 0)
+		setstatus("read %s, %d edits from the journal", name, n);
+}
+
+/*
+ * Start writing the map out in full, after which the journal
+ * need hold only the records from here on.  replaced says the
+ * map was read in, rather than built by the edits journaled;
+ * binary, unless it is -1, sets the form the map file is written
+ * in from now on.  Returns -1 if the write cannot start yet.
+ */
+int
+journalcompact(int replaced, int binary)
+{
+	uvlong path;
+
+	if(mapname == nil || compacting) {
+		werrstr("busy");
+		return -1;
+	}
+	if(jfd < 0) {
+		if((jfd = create(jnlname, ORDWR|OEXCL, 0666)) < 0) {
+			setstatus("%s: %r; not journaling", jnlname);
+			mapname = nil;
+			return -1;
+		}
+		jsize = 0;
+	}
+	if(snapshotmap(mapname, binary < 0 ? mapbinary : binary, &path) < 0)
+		return -1;
+	if(binary >= 0)
+		mapbinary = binary;  /* Kept to from now on */
+
+	/*
+	 * The new map file is known by its qid.path from the start, and
+	 * until it is in place nothing has that qid, so the S can go in
+	 * straight away: there is no moment at which the journal does
+	 * not say where to play it from.
+	 */
+	record(replaced ? "Z\n" : "R\n");
+	jmark = jsize;
+	record("S %llud\n", path);
+	renumber(0);
+	compacting = 1;
+	return 0;
+}
+
+/* Compact the journal if it has grown enough, once it is safe to */
+void
+journalcheck(void)
+{
+	if(jfd >= 0 && !compacting && jsize > JMINSIZE && jsize > mapsize/4)
+		journalcompact(0, -1);
+}
+
+/*
+ * The map file journalcompact began writing is in place, unless
+ * ok is clear: cut the journal down to what came after it.
+ */
+void
+journalcommit(int ok)
+{
+	char *tmp, buf[8192];
+	vlong off, end;
+	Dir *d;
+	long n;
+	int fd;
+
+	compacting = 0;
+	if(!ok || jfd < 0)
+		return;
+	if((d = dirstat(mapname)) != nil) {
+		mapsize = d->length;
+		free(d);
+	}
+
+	tmp = smprint("%s.tmp", jnlname);
+	if(tmp == nil)
+		sysfatal("smprint failed: %r");
+	if((fd = create(tmp, ORDWR|OEXCL, 0666)) < 0)
+		goto err;
+	end = jsize;
+	for(off = jmark; off < end; off += n) {
+		n = end - off;
+		if(n > sizeof(buf))
+			n = sizeof(buf);
+		if(pread(jfd, buf, n, off) != n || write(fd, buf, n) != n)
+			goto err;
+	}
+	if(replacefile(tmp, jnlname) < 0) {
+		/* The whole journal may be in tmp by now, so leave it be */
+		setstatus("%s: %r", jnlname);
+		close(fd);
+		free(tmp);
+		return;
+	}
+	close(jfd);
+	jfd = fd;
+	jsize = end - jmark;
+	free(tmp);
+	return;
+
+err:
+	/* The old journal still holds everything */
+	setstatus("%s: %r", jnlname);
+	if(fd >= 0) {
+		close(fd);
+		remove(tmp);
+	}
+	free(tmp);
+}
@@ -0,0 +1,770 @@
+#include "mindthemap.h"
+
+/*
+ * Maps are laid out as tidy trees, growing across with depth and
+ * packed down the page: each subtree is pushed just clear of its
+ * left siblings' subtrees, level by level along their contours,
+ * and every parent is centred on its children.  This is Walker's
+ * algorithm in the linear-time form of Buchheim, Jünger and
+ * Leipert, run without recursion over a preorder copy of the tree
+ * kept in the Layout.
+ *
+ * The packing keeps apart only nodes at the same depth, so the
+ * nodes at one depth of a tidy tree share a column as wide as the
+ * widest of them; nodes at different depths then never meet,
+ * however their widths vary.
+ *
+ * A node the user has placed by hand takes no part in its parent's
+ * packing.  It stays where it was put and heads a tidy tree of its
+ * own, so its automatically placed descendants follow it about.
+ *
+ * All the state a layout needs lives in a Layout, so any number of
+ * them can run, on different maps or different subtrees.  The
+ * current map has a Layout of its own that also remembers what
+ * edits have changed since its last pass.
+ *
+ * On a big map the walks are shared out among $NPROC procs.  Small
+ * subtrees near the bottom depend on nothing outside themselves
+ * but their heads, so each is a task any proc can take, while the
+ * main proc does the few nodes above them.  Text is measured as
+ * the tree is copied, on the main proc, as the font belongs to it.
+ */
+enum {
+	DIST = NODEH + VSPACE,  /* Least distance between the tops of neighbouring nodes */
+	PARNODES = 20000,       /* Smaller maps are laid out on one proc */
+	TASKSPERPROC = 8
+};
+
+/* One layout pass, shared out among procs a subtree at a time */
+typedef struct Walk Walk;
+struct Walk {
+	Layout *l;
+	int *task;       /* Heads of subtrees handed out whole */
+	int ntask;
+	int nproc;
+	void (*f)(Walk*, int);  /* What to do with each task */
+	long next;       /* Next task to take */
+	long done;       /* Raised by each proc as it finishes */
+	int top;         /* Where the top of the main tree goes */
+	double min;      /* How far up the main tree reaches */
+	double *tmin;    /* The same for the part under each task */
+	int *right;      /* How far right the part under each task reaches */
+};
+
+static int nproc;  /* Procs to lay out with, 0 until $NPROC is read */
+
+/* Make an empty layout context */
+Layout*
+layoutcreate(void)
+{
+	Layout *l;
+
+	l = mallocz(sizeof(Layout), 1);
+	if(l == nil)
+		sysfatal("malloc failed: %r");
+	l->xpos = MARGIN;  /* Remove dependency on maprect */
+	l->ypos = MARGIN;
+	l->all = 1;
+	return l;
+}
+
+/* Release a layout context */
+void
+layoutfree(Layout *l)
+{
+	if(l == nil)
+		return;
+	free(l->place);
+	free(l->colw);
+	free(l->colx);
+	free(l->dirty);
+	free(l);
+}
+
+/* Add a node to the preorder copy, linking it in with its parent's placed children */
+static void
+addplace(Layout *l, Node *n, int parent)
+{
+	Place *p, *pp;
+	int i;
+
+	if(l->n == l->cap) {
+		l->cap = l->cap ? 2*l->cap : 1024;
+		l->place = realloc(l->place, l->cap*sizeof(Place));
+		if(l->place == nil)
+			sysfatal("realloc failed: %r");
+	}
+	i = l->n++;
+	p = &l->place[i];
+	memset(p, 0, sizeof(Place));
+	p->node = n;
+	p->parent = parent;
+	measurenode(n);
+	p->first = p->last = p->prev = p->next = p->thread = -1;
+	p->ancestor = i;
+	p->number = 1;
+
+	/* Nodes placed by hand head trees of their own */
+	if(parent < 0 || n->manual_pos) {
+		p->top = i;
+		p->levels = 1;
+		return;
+	}
+	pp = &l->place[parent];
+	p->top = pp->top;
+	p->depth = pp->depth + 1;
+	if(p->depth >= l->place[p->top].levels)
+		l->place[p->top].levels = p->depth + 1;
+	p->prev = pp->last;
+	if(pp->last >= 0) {
+		l->place[pp->last].next = i;
+		p->number = l->place[pp->last].number + 1;
+	} else
+		pp->first = pp->dflt = i;
+	pp->last = i;
+}
+
+/* Copy the subtree under node in preorder */
+static void
+copytree(Layout *l, Node *node)
+{
+	Treewalk w;
+	Node *n;
+	int i;
+
+	l->n = 0;
+	i = -1;  /* Place of the node the walk is in */
+	walkstart(&w, node);
+	while((n = walkstep(&w)) != nil) {
+		if(w.leaving) {
+			l->place[i].end = l->n;
+			i = l->place[i].parent;
+		} else {
+			addplace(l, n, i);
+			i = l->n - 1;
+		}
+	}
+}
+
+/* Size the columns of each tidy tree to the widest node at its depth */
+static void
+columns(Layout *l)
+{
+	Place *pl;
+	int i, c, w;
+
+	pl = l->place;
+	l->ncol = 0;
+	for(i = 0; i < l->n; i++)
+		if(pl[i].top == i) {
+			pl[i].col = l->ncol;
+			l->ncol += pl[i].levels;
+		}
+	if(l->ncol > l->colcap) {
+		l->colcap = l->ncol;
+		free(l->colw);
+		free(l->colx);
+		l->colw = malloc(l->colcap*sizeof(l->colw[0]));
+		l->colx = malloc(l->colcap*sizeof(l->colx[0]));
+		if(l->colw == nil || l->colx == nil)
+			sysfatal("malloc failed: %r");
+	}
+	memset(l->colw, 0, l->ncol*sizeof(l->colw[0]));
+	for(i = 0; i < l->n; i++) {
+		w = pl[i].node->width;
+		if(w < MINW)
+			w = MINW;
+		c = pl[pl[i].top].col + pl[i].depth;
+		if(w > l->colw[c])
+			l->colw[c] = w;
+	}
+	for(i = 0; i < l->n; i++)
+		if(pl[i].top == i) {
+			c = pl[i].col;
+			l->colx[c] = 0;
+			for(c++; c < pl[i].col + pl[i].levels; c++)
+				l->colx[c] = l->colx[c-1] + l->colw[c-1] + HSPACE;
+		}
+}
+
+/* Next node down the top and bottom contours of a subtree */
+static int
+nextleft(Place *pl, int v)
+{
+	return pl[v].first >= 0 ? pl[v].first : pl[v].thread;
+}
+
+static int
+nextright(Place *pl, int v)
+{
+	return pl[v].last >= 0 ? pl[v].last : pl[v].thread;
+}
+
+/* Move the subtree at wr down, spreading the move over the subtrees between wl and wr */
+static void
+movesubtree(Place *pl, int wl, int wr, double shift)
+{
+	double subtrees;
+
+	subtrees = pl[wr].number - pl[wl].number;
+	pl[wr].change -= shift / subtrees;
+	pl[wr].shift += shift;
+	pl[wl].change += shift / subtrees;
+	pl[wr].prelim += shift;
+	pl[wr].mod += shift;
+}
+
+/* Apply the moves recorded by movesubtree to all the children of v */
+static void
+executeshifts(Place *pl, int v)
+{
+	double shift, change;
+	int w;
+
+	shift = change = 0;
+	for(w = pl[v].last; w >= 0; w = pl[w].prev) {
+		pl[w].prelim += shift;
+		pl[w].mod += shift;
+		change += pl[w].change;
+		shift += pl[w].shift + change;
+	}
+}
+
+/*
+ * Push the subtree at v clear of those of its earlier siblings,
+ * walking down the facing contours, and thread the contours
+ * together so that later siblings can do the same.  Returns the
+ * new default ancestor.
+ */
+static int
+apportion(Place *pl, int v, int dflt)
+{
+	int vir, vor, vil, vol, a;
+	double sir, sor, sil, sol, shift;
+
+	if(pl[v].prev < 0)
+		return dflt;
+
+	vir = vor = v;
+	vil = pl[v].prev;
+	vol = pl[pl[v].parent].first;
+	sir = pl[vir].mod;
+	sor = pl[vor].mod;
+	sil = pl[vil].mod;
+	sol = pl[vol].mod;
+	while(nextright(pl, vil) >= 0 && nextleft(pl, vir) >= 0) {
+		vil = nextright(pl, vil);
+		vir = nextleft(pl, vir);
+		vol = nextleft(pl, vol);
+		vor = nextright(pl, vor);
+		pl[vor].ancestor = v;
+		shift = (pl[vil].prelim + sil) - (pl[vir].prelim + sir) + DIST;
+		if(shift > 0) {
+			a = pl[vil].ancestor;
+			if(pl[a].parent != pl[v].parent)
+				a = dflt;
+			movesubtree(pl, a, v, shift);
+			sir += shift;
+			sor += shift;
+		}
+		sil += pl[vil].mod;
+		sir += pl[vir].mod;
+		sol += pl[vol].mod;
+		sor += pl[vor].mod;
+	}
+	if(nextright(pl, vil) >= 0 && nextright(pl, vor) < 0) {
+		pl[vor].thread = nextright(pl, vil);
+		pl[vor].mod += sil - sor;
+	}
+	if(nextleft(pl, vir) >= 0 && nextleft(pl, vol) < 0) {
+		pl[vol].thread = nextleft(pl, vir);
+		pl[vol].mod += sir - sol;
+		dflt = v;
+	}
+	return dflt;
+}
+
+/* Give v its preliminary place, once all its children have theirs */
+static void
+firstplace(Place *pl, int v)
+{
+	Place *p;
+	double mid;
+
+	p = &pl[v];
+	if(p->first < 0)
+		p->prelim = p->prev >= 0 ? pl[p->prev].prelim + DIST : 0;
+	else {
+		executeshifts(pl, v);
+		mid = (pl[p->first].prelim + pl[p->last].prelim) / 2;
+		if(p->prev >= 0) {
+			p->prelim = pl[p->prev].prelim + DIST;
+			p->mod = p->prelim - mid;
+		} else
+			p->prelim = mid;
+	}
+	if(p->top != v)
+		pl[p->parent].dflt = apportion(pl, v, pl[p->parent].dflt);
+}
+
+/* The first walk: visit the tidy tree headed by r in postorder */
+static void
+firstwalk(Place *pl, int r)
+{
+	int v;
+
+	v = r;
+	for(;;) {
+		/* Tasks have already been walked below */
+		while(pl[v].first >= 0 && (v == r || !pl[v].task))
+			v = pl[v].first;
+		for(;;) {
+			firstplace(pl, v);
+			if(v == r)
+				return;
+			if(pl[v].next >= 0) {
+				v = pl[v].next;
+				break;
+			}
+			v = pl[v].parent;
+		}
+	}
+}
+
+/* Take tasks until there are none left */
+static void
+walktasks(Walk *w)
+{
+	long t;
+
+	while((t = ainc(&w->next) - 1) < w->ntask)
+		w->f(w, t);
+}
+
+static void
+walkproc(void *v)
+{
+	Walk *w;
+
+	w = v;
+	walktasks(w);
+	semrelease(&w->done, 1);
+}
+
+/* Do f to every task, sharing them out among the walk's procs */
+static void
+share(Walk *w, void (*f)(Walk*, int))
+{
+	int started;
+
+	if(w->ntask == 0)
+		return;
+	w->f = f;
+	w->next = 0;
+	started = 0;
+	while(started < w->nproc-1 && newproc(walkproc, w) >= 0)
+		started++;
+	walktasks(w);
+	while(started-- > 0)
+		semacquire(&w->done, 1);
+}
+
+/* Number of procs to lay out with */
+static int
+layoutprocs(void)
+{
+	char *s;
+
+	if(nproc == 0) {
+		nproc = 1;
+		if((s = getenv("NPROC")) != nil) {
+			nproc = atoi(s);
+			free(s);
+		}
+		if(nproc < 1)
+			nproc = 1;
+	}
+	return nproc;
+}
+
+/*
+ * Set up a pass over the copied tree.  If it is big enough to be
+ * worth sharing out, the tasks are the biggest subtrees under a
+ * size that gives each proc a few.
+ */
+static Walk*
+newwalk(Layout *l, int top)
+{
+	Place *pl;
+	Walk *w;
+	int i, n, max;
+
+	w = mallocz(sizeof(Walk), 1);
+	if(w == nil)
+		sysfatal("malloc failed: %r");
+	w->l = l;
+	w->top = top;
+	w->nproc = l->n < PARNODES ? 1 : layoutprocs();
+	if(w->nproc == 1)
+		return w;
+
+	pl = l->place;
+	max = l->n / (TASKSPERPROC*w->nproc);
+	if(max < 1)
+		max = 1;
+	for(i = 1, n = 0; i < l->n; i++)
+		if(pl[i].end - i <= max) {
+			n++;
+			i = pl[i].end - 1;
+		}
+	w->task = malloc(n*sizeof(w->task[0]));
+	w->tmin = malloc(n*sizeof(w->tmin[0]));
+	w->right = malloc(n*sizeof(w->right[0]));
+	if(w->task == nil || w->tmin == nil || w->right == nil)
+		sysfatal("malloc failed: %r");
+	for(i = 1; i < l->n; i++)
+		if(pl[i].end - i <= max) {
+			pl[i].task = 1;
+			w->task[w->ntask++] = i;
+			i = pl[i].end - 1;
+		}
+	return w;
+}
+
+static void
+freewalk(Walk *w)
+{
+	free(w->task);
+	free(w->tmin);
+	free(w->right);
+	free(w);
+}
+
+/* The first walk under a task's head, which is placed among its siblings later */
+static void
+firsttask(Walk *w, int t)
+{
+	Place *pl;
+	int h, i, v;
+
+	pl = w->l->place;
+	h = w->task[t];
+	for(i = h+1; i < pl[h].end; i++)
+		if(pl[i].top == i)
+			firstwalk(pl, i);
+	if(pl[h].top == h)
+		firstwalk(pl, h);
+	else
+		for(v = pl[h].first; v >= 0; v = pl[v].next)
+			firstwalk(pl, v);
+}
+
+/*
+ * The second walk at node i, once it is done at the parent: add
+ * up the modifiers above the node, in shift now the first walk is
+ * done with it, and see how far up the main tree reaches.
+ */
+static void
+secondplace(Place *pl, int i, double *min)
+{
+	Place *p;
+
+	p = &pl[i];
+	if(p->top == i)
+		p->shift = 0;
+	else
+		p->shift = pl[p->parent].shift + pl[p->parent].mod;
+	p->prelim += p->shift;
+	if(p->top == 0 && (i == 0 || p->prelim < *min))
+		*min = p->prelim;
+}
+
+static void
+secondtask(Walk *w, int t)
+{
+	Place *pl;
+	double min;
+	int h, i;
+
+	pl = w->l->place;
+	h = w->task[t];
+	min = w->min;
+	for(i = h+1; i < pl[h].end; i++)
+		secondplace(pl, i, &min);
+	w->tmin[t] = min;
+}
+
+/* Put node i in its final place, after its parent; returns its right edge */
+static int
+finalplace(Walk *w, int i)
+{
+	Place *pl, *p;
+	Node *n;
+	double y;
+	int width;
+
+	pl = w->l->place;
+	p = &pl[i];
+	n = p->node;
+	n->dirty = 0;
+
+	/* Where each tidy tree goes, in change at its head */
+	if(p->top == i) {
+		if(n->manual_pos)
+			p->change = n->pos.y - p->prelim;
+		else
+			p->change = w->top - w->min;
+	}
+
+	/* Measured as the tree was copied */
+	width = n->width;
+	if(width < MINW)
+		width = MINW;
+
+	/* Only position nodes that aren't manually placed */
+	if(!n->manual_pos) {
+		y = p->prelim + pl[p->top].change;
+		n->pos.y = y < 0 ? y - 0.5 : y + 0.5;
+		if(p->top != i)
+			n->pos.x = pl[p->top].node->pos.x + w->l->colx[pl[p->top].col + p->depth];
+		else if(n->parent != nil)
+			n->pos.x = n->parent->bounds.max.x + HSPACE;
+		else
+			n->pos.x = w->l->xpos;
+		if(p->top != i)
+			p->rel = n->pos.y - pl[p->parent].node->pos.y;
+	}
+	n->bounds = (Rectangle){
+		Pt(n->pos.x, n->pos.y),
+		Pt(n->pos.x + width, n->pos.y + NODEH)
+	};
+	return n->bounds.max.x;
+}
+
+static void
+finaltask(Walk *w, int t)
+{
+	Place *pl;
+	int h, i, x, right;
+
+	pl = w->l->place;
+	h = w->task[t];
+	right = 0;
+	for(i = h+1; i < pl[h].end; i++)
+		if((x = finalplace(w, i)) > right)
+			right = x;
+	w->right[t] = right;
+}
+
+/*
+ * Lay out the subtree under node from scratch, with the top of
+ * its automatically placed part at y = top.  Node itself goes
+ * just right of its parent, if it has one.  The walk follows the
+ * nodes' own links, so it works on any map, not just the current
+ * one.  Each walk does the nodes above the tasks itself, stopping
+ * short at them, and shares the tasks out before or after as
+ * the walk's direction needs.
+ */
+void
+layouttree(Layout *l, Node *node, int top)
+{
+	Place *pl;
+	Walk *w;
+	int i, t, x;
+
+	copytree(l, node);
+	columns(l);
+	pl = l->place;
+	w = newwalk(l, top);
+
+	/* Preliminary places, bottom up */
+	share(w, firsttask);
+	for(i = 0; i < l->n; i = pl[i].task ? pl[i].end : i+1)
+		if(!pl[i].task && pl[i].top == i)
+			firstwalk(pl, i);
+
+	/* Then top down */
+	w->min = 0;
+	for(i = 0; i < l->n; i = pl[i].task ? pl[i].end : i+1)
+		secondplace(pl, i, &w->min);
+	share(w, secondtask);
+	for(t = 0; t < w->ntask; t++)
+		if(w->tmin[t] < w->min)
+			w->min = w->tmin[t];
+
+	/* Final places, parents before children */
+	l->maxwidth = 0;
+	for(i = 0; i < l->n; i = pl[i].task ? pl[i].end : i+1)
+		if((x = finalplace(w, i)) > l->maxwidth)
+			l->maxwidth = x;
+	share(w, finaltask);
+	for(t = 0; t < w->ntask; t++)
+		if(w->right[t] > l->maxwidth)
+			l->maxwidth = w->right[t];
+
+	freewalk(w);
+}
+
+/* Note that a node is new, has new text or has been moved, so it must be placed again */
+void
+layoutdirty(Layout *l, Node *node)
+{
+	if(node->dirty)
+		return;
+	node->dirty = 1;
+	if(l->ndirty == l->dirtycap) {
+		l->dirtycap = l->dirtycap ? 2*l->dirtycap : 64;
+		l->dirty = realloc(l->dirty, l->dirtycap*sizeof(l->dirty[0]));
+		if(l->dirty == nil)
+			sysfatal("realloc failed: %r");
+	}
+	l->dirty[l->ndirty++] = node;
+}
+
+/*
+ * Place the node at index s of the tree store again after its
+ * width or position has changed.  With the shape of the tree the
+ * same, its automatically placed descendants keep their columns
+ * and their offsets from their parents as of the last full pass
+ * and just follow them about; descendants placed by hand stay put,
+ * and so do theirs.  If anything moves, the window is damaged
+ * where the subtree was and where it is now; if not, only the node
+ * itself is redrawn.  Returns -1, leaving the rest to a full pass,
+ * if a node has grown too wide for its column.
+ */
+static int
+replace(Layout *l, int s)
+{
+	Place *pl;
+	Node *n;
+	Rectangle was, r;
+	int i, end, width, moved;
+
+	pl = l->place;
+	was = tree.span[s];
+	if(tree.parent[s] >= 0)
+		combinerect(&was, tree.bounds[tree.parent[s]]);
+	moved = 0;
+	end = tree.end[s];
+	for(i = s; i < end; i++) {
+		n = tree.node[i];
+		n->dirty = 0;
+		width = measurenode(n);
+		if(width < MINW)
+			width = MINW;
+		if(width > l->colw[pl[pl[i].top].col + pl[i].depth])
+			return -1;
+		if(i > s) {
+			if(n->manual_pos) {
+				i = tree.end[i] - 1;
+				continue;
+			}
+			n->pos.x = pl[pl[i].top].node->pos.x + l->colx[pl[pl[i].top].col + pl[i].depth];
+			n->pos.y = tree.bounds[tree.parent[i]].min.y + pl[i].rel;
+		}
+		r = (Rectangle){
+			Pt(n->pos.x, n->pos.y),
+			Pt(n->pos.x + width, n->pos.y + NODEH)
+		};
+		if(!eqrect(r, tree.bounds[i]))
+			moved = 1;
+		setbounds(n, r);
+		if(n->bounds.max.x > l->maxwidth)
+			l->maxwidth = n->bounds.max.x;
+	}
+	if(!moved) {
+		damage(tree.bounds[s]);
+		return 0;
+	}
+	treespans(s);
+	damage(was);
+	damagetree(s);
+	return 0;
+}
+
+/*
+ * Bring the current map's layout up to date.  A change to the
+ * shape of the tree can move nodes anywhere, so it costs a full
+ * pass, though one that measures only new text.  Edits that leave
+ * the shape alone, typing and dragging, only move the subtrees of
+ * the nodes they touch, unless typing widens a column; when nothing
+ * has changed this costs nothing.
+ */
+void
+layoutupdate(Layout *l, Node *root)
+{
+	int i;
+
+	treeupdate(root);
+	if(root == nil || tree.n == 0)
+		return;
+
+	if(!l->all && !tree.reshaped) {
+		/* Those not dirty now have been deleted or placed since */
+		for(i = 0; i < l->ndirty; i++)
+			if(l->dirty[i]->dirty && replace(l, l->dirty[i]->idx) < 0)
+				break;
+		if(i == l->ndirty) {
+			l->ndirty = 0;
+			return;
+		}
+	}
+
+	/* Copied from the root, the layout's indices are the store's */
+	layouttree(l, root, l->ypos);
+	treebounds();
+	damageall();
+	l->all = 0;
+	l->ndirty = 0;
+	tree.reshaped = 0;
+}
+
+/*
+ * Lay out the current map, headed by node, afresh with the top of
+ * its tree at y = offset, where later passes keep it.
+ */
+void
+center_tree_auto(Node *node, int offset)
+{
+	maplayout->ypos = offset;
+	maplayout->all = 1;
+	layoutupdate(maplayout, node);
+}
+
+/*
+ * Calculate positions for nodes of the current map.  Only the map
+ * as a whole is laid out, so that the offsets kept for placing
+ * subtrees again always come from the same pass.
+ */
+void
+layoutmap(Node *node, int depth)
+{
+	USED(depth);
+	if(node != nil)
+		layoutupdate(maplayout, node);
+}
+
+/* Note a change to a node of the current map */
+void
+markdirty(Node *node)
+{
+	layoutdirty(maplayout, node);
+}
+
+/* Note that the current map must be laid out afresh though its nodes are all the same */
+void
+layoutreshape(void)
+{
+	maplayout->all = 1;
+}
+
+/* Throw away pending layout work, as when the whole map is replaced */
+void
+layoutreset(void)
+{
+	if(maplayout == nil)
+		maplayout = layoutcreate();
+	maplayout->ndirty = 0;
+	maplayout->all = 1;
+	treestale();
+}
@@ -1,16 +1,5 @@
 #include "mindthemap.h"
 
-enum {
-	MARGIN = 30,      /* Reduced margin for better use of space */
-	HSPACE = 80,      /* Reduced horizontal space between nodes */
-	VSPACE = 50,      /* Reduced vertical space between nodes */
-	MINW = 100,       /* Reduced minimum node width */
-	NODEH = 30,       /* Reduced node height */
-	PADDING = 10,     /* Reduced text padding inside nodes */
-	CORNER = 8,       /* Corner sprite size (unchanged) */
-	CONN = 4          /* Connection point sprite size (unchanged) */
-};
-
 /* Rio-inspired colors */
 Image *back;    /* Background - pale yellow */
 Image *high;    /* Highlight - pale blue */
@@ -19,6 +8,8 @@ Image *text;    /* Text - black */
 Image *pale;    /* Pale - light blue */
 Image *corner_sprites[4][4];  /* Corner sprites for each color combination */
 Image *conn_dots[4];          /* Connection dots for each color */
+Image *corner_masks[4];       /* Where each corner sprite is drawn */
+Image *conn_mask;             /* Where a connection dot is drawn */
 
 /* Global variables */
 int mode = NORMAL;
@@ -28,10 +19,66 @@ struct Image *screen;
 struct Font *font;
 struct Display *display;
 Rectangle maprect;
-Point viewport = {0, 0};  /* Current viewport offset for panning */
+Point viewport = {0, 0};  /* Current viewport offset for panning, in window pixels */
+int zoom = 0;  /* The map is drawn at 1/(1<<zoom) of its size */
 Point pan_start = {0, 0};  /* Starting point for panning */
 int panning = 0;  /* Flag to indicate if we're panning the viewport */
-char *argv0;
+Point drag_offset;  /* Offset from mouse position of the node being dragged */
+Nodepool *nodepool;  /* Memory behind the current map */
+int lazyload = 0;  /* Read binary maps in on demand */
+int showstats = 0;  /* Show allocation statistics in the status line */
+int maxfps = 0;  /* Most frames drawn a second, 0 for no limit */
+int journaling = 0;  /* Keep a journal of edits to the map file */
+int nexpanded;  /* Stubs read in while drawing */
+Layout *maplayout;  /* Layout state of the current map */
+
+/*
+ * Parts of the window to draw again, noted as edits touch them.
+ * drawmap clears and repaints just these, clipped to each in turn,
+ * rather than the whole window; the status line is repainted only
+ * when its text changes or damage reaches it.
+ */
+enum {
+	NDAMAGE = 16  /* Rectangles kept apart before they are merged */
+};
+Rectangle damaged[NDAMAGE];
+int ndamaged;
+int fulldamage = 1;  /* Draw the whole window */
+Rectangle drawclip;  /* Part of the window being drawn, and a little more */
+Image *canvas;  /* Back buffer the map is drawn in before it goes to the screen */
+int scrolled;  /* Canvas moved under the window since it was last shown */
+
+/*
+ * Maps are read and written by a proc of their own, one job at a
+ * time, so a big map or a slow command never holds up the window.
+ * A write works on a copy of the map taken as it starts, leaving
+ * the map free to be edited meanwhile; a read builds the new map in
+ * a pool of its own, which replaces the current map in one step
+ * once it is all in.  The proc says it is done with a byte down
+ * jobpipe, which the event loop watches, and a timer keeps its
+ * progress in the status line up to date while it works.
+ */
+enum {
+	JOBTICK = 250  /* Milliseconds between progress reports */
+};
+typedef struct Job {
+	char *name;      /* File, or command if cmd is set */
+	int cmd;
+	int writing;
+	int binary;
+	int snapshot;    /* Writes out the journaled map file */
+	int fd;          /* Being written to */
+	char *tmp;       /* Temp file fd is, which replaces name, or nil */
+	uvlong path;     /* Its qid.path */
+	Nodepool *pool;  /* The map read in, or the copy being written out */
+	Node *root;
+	char err[ERRMAX];  /* Why it failed, empty if it did not */
+} Job;
+Job *job;  /* Under way, nil if none */
+int jobpipe[2];
+ulong Ejob;  /* Event key of jobpipe */
+ulong Etick;  /* Event key of the progress timer */
+char jobmsg[ERRMAX+256];  /* How the last job went, or other news */
 
 /* Initialize colors */
 void
@@ -47,6 +94,139 @@ initcolors(void)
 		sysfatal("allocimage failed");
 }
 
+/* Sprites are kept for each of the colors a node or line can be drawn in */
+static Image**
+palette(void)
+{
+	static Image *p[4];
+	
+	p[0] = back;
+	p[1] = high;
+	p[2] = bord;
+	p[3] = pale;
+	return p;
+}
+
+/* Which sprites go with a color */
+int
+colorindex(Image *c)
+{
+	Image **p;
+	int i;
+	
+	p = palette();
+	for(i = 0; i < 4; i++)
+		if(p[i] == c)
+			return i;
+	return 0;
+}
+
+/* Make a mask from a function of each pixel, 255 where it is drawn */
+static Image*
+makemask(int n, int (*f)(int, int, int))
+{
+	uchar buf[CORNER*CORNER];
+	Image *m;
+	int x, y;
+	
+	m = allocimage(display, Rect(0, 0, n, n), GREY8, 0, DBlack);
+	if(m == nil)
+		sysfatal("allocimage failed: %r");
+	for(y = 0; y < n; y++)
+		for(x = 0; x < n; x++)
+			buf[y*n + x] = f(x, y, n) ? 255 : 0;
+	if(loadimage(m, m->r, buf, n*n) < 0)
+		sysfatal("loadimage failed: %r");
+	return m;
+}
+
+/*
+ * Squared distance, in quarter pixels, from the middle of pixel
+ * (x, y) of corner k to the centre of the corner's curve.  Corners
+ * go clockwise from the top left.
+ */
+static int
+cornerdist(int k, int x, int y, int n)
+{
+	int dx, dy;
+	
+	dx = 2*x + 1 - (k == 0 || k == 3 ? 2*n : 0);
+	dy = 2*y + 1 - (k < 2 ? 2*n : 0);
+	return dx*dx + dy*dy;
+}
+
+static int cornerk;  /* Corner being made */
+
+/* Inside the curve, border and all */
+static int
+incorner(int x, int y, int n)
+{
+	return cornerdist(cornerk, x, y, n) <= 4*n*n;
+}
+
+/* On the border */
+static int
+oncorner(int x, int y, int n)
+{
+	return incorner(x, y, n) && cornerdist(cornerk, x, y, n) > 4*(n-1)*(n-1);
+}
+
+static int
+indot(int x, int y, int n)
+{
+	int dx, dy;
+	
+	dx = 2*x + 1 - n;
+	dy = 2*y + 1 - n;
+	return dx*dx + dy*dy <= n*n;
+}
+
+/*
+ * Render the node corners and connection dots once for every
+ * color, so that drawing a node or line copies them into place
+ * rather than tracing curves.
+ */
+void
+initsprites(void)
+{
+	Image **p, *line;
+	Rectangle r;
+	int i, k;
+	
+	for(k = 0; k < 4; k++) {
+		freeimage(corner_masks[k]);
+		for(i = 0; i < 4; i++)
+			freeimage(corner_sprites[i][k]);
+	}
+	for(i = 0; i < 4; i++)
+		freeimage(conn_dots[i]);
+	freeimage(conn_mask);
+	
+	p = palette();
+	r = Rect(0, 0, CORNER, CORNER);
+	for(k = 0; k < 4; k++) {
+		cornerk = k;
+		corner_masks[k] = makemask(CORNER, incorner);
+		line = makemask(CORNER, oncorner);
+		for(i = 0; i < 4; i++) {
+			corner_sprites[i][k] = allocimage(display, r, screen->chan, 0, DNofill);
+			if(corner_sprites[i][k] == nil)
+				sysfatal("allocimage failed: %r");
+			draw(corner_sprites[i][k], r, p[i], nil, ZP);
+			draw(corner_sprites[i][k], r, bord, line, ZP);
+		}
+		freeimage(line);
+	}
+	
+	conn_mask = makemask(CONN, indot);
+	for(i = 0; i < 4; i++) {
+		conn_dots[i] = allocimage(display, Rect(0, 0, CONN, CONN), screen->chan, 0, DNofill);
+		if(conn_dots[i] == nil)
+			sysfatal("allocimage failed: %r");
+		draw(conn_dots[i], conn_dots[i]->r, p[i], nil, ZP);
+	}
+}
+
 /* Calculate node width based on text */
 int
 nodewidth(char *text)
@@ -56,70 +236,53 @@ nodewidth(char *text)
 	return p.x + (2 * PADDING);  /* Text width plus padding on both sides */
 }
 
-/* Draw a rounded rectangle using bezier curves */
+/* Width of a node's text, measured only the first time it is asked for */
+int
+measurenode(Node *node)
+{
+	if(node->width == 0)
+		node->width = nodewidth(node->text);
+	return node->width;
+}
+
+/* Forget every measured width, as when the font changes */
 void
-roundedrect(Image *dst, Rectangle r, Image *src, Point sp, int style)
+flushwidths(void)
 {
-	int radius = 8;  /* Corner radius */
-	Point p[12];     /* Points for the rounded corners */
-	
-	/* Draw the main rectangle body */
-	Rectangle body = r;
-	body.min.x += radius;
-	body.max.x -= radius;
-	draw(dst, body, src, nil, sp);
-	
-	/* Draw top and bottom bars */
-	draw(dst, Rect(r.min.x+radius, r.min.y, r.max.x-radius, r.min.y+radius), src, nil, sp);
-	draw(dst, Rect(r.min.x+radius, r.max.y-radius, r.max.x-radius, r.max.y), src, nil, sp);
-	
-	/* Draw left and right bars */
-	draw(dst, Rect(r.min.x, r.min.y+radius, r.min.x+radius, r.max.y-radius), src, nil, sp);
-	draw(dst, Rect(r.max.x-radius, r.min.y+radius, r.max.x, r.max.y-radius), src, nil, sp);
-	
-	/* Use the appropriate border color based on the node's state */
-	Image *border = bord;  /* Default to normal border color */
-	
-	/* Top-left corner */
-	p[0] = Pt(r.min.x+radius, r.min.y);          /* Start */
-	p[1] = Pt(r.min.x+radius/2, r.min.y);        /* Control point 1 */
-	p[2] = Pt(r.min.x, r.min.y+radius/2);        /* Control point 2 */
-	p[3] = Pt(r.min.x, r.min.y+radius);          /* End */
-	
-	/* Top-right corner */
-	p[4] = Pt(r.max.x-radius, r.min.y);
-	p[5] = Pt(r.max.x-radius/2, r.min.y);
-	p[6] = Pt(r.max.x, r.min.y+radius/2);
-	p[7] = Pt(r.max.x, r.min.y+radius);
-	
-	/* Bottom-right corner */
-	p[8] = Pt(r.max.x, r.max.y-radius);
-	p[9] = Pt(r.max.x, r.max.y-radius/2);
-	p[10] = Pt(r.max.x-radius/2, r.max.y);
-	p[11] = Pt(r.max.x-radius, r.max.y);
-	
-	/* Draw the bezier curves for each corner */
-	bezier(dst, p[0], p[1], p[2], p[3], Enddisc, Enddisc, 1, border, ZP);
-	bezier(dst, p[4], p[5], p[6], p[7], Enddisc, Enddisc, 1, border, ZP);
-	bezier(dst, p[8], p[9], p[10], p[11], Enddisc, Enddisc, 1, border, ZP);
-	
-	/* Bottom-left corner */
-	p[0] = Pt(r.min.x, r.max.y-radius);
-	p[1] = Pt(r.min.x, r.max.y-radius/2);
-	p[2] = Pt(r.min.x+radius/2, r.max.y);
-	p[3] = Pt(r.min.x+radius, r.max.y);
-	bezier(dst, p[0], p[1], p[2], p[3], Enddisc, Enddisc, 1, border, ZP);
+	int i;
 	
-	/* Draw straight lines for the borders */
-	draw(dst, Rect(r.min.x+radius, r.min.y, r.max.x-radius, r.min.y+1), border, nil, ZP);  /* Top */
-	draw(dst, Rect(r.min.x+radius, r.max.y-1, r.max.x-radius, r.max.y), border, nil, ZP);  /* Bottom */
-	draw(dst, Rect(r.min.x, r.min.y+radius, r.min.x+1, r.max.y-radius), border, nil, ZP);  /* Left */
-	draw(dst, Rect(r.max.x-1, r.min.y+radius, r.max.x, r.max.y-radius), border, nil, ZP);  /* Right */
+	treeupdate(root);
+	for(i = 0; i < tree.n; i++)
+		tree.node[i]->width = 0;
+	layoutreset();
+}
+
+/* Draw a rounded rectangle from the corner sprites for its color */
+void
+roundedrect(Image *dst, Rectangle r, Image *src, Point sp, int style)
+{
+	Image **c;
+	int R = CORNER;
+	
+	/* Border color across the middle both ways, then the inside over it */
+	draw(dst, Rect(r.min.x+R, r.min.y, r.max.x-R, r.max.y), bord, nil, ZP);
+	draw(dst, Rect(r.min.x, r.min.y+R, r.max.x, r.max.y-R), bord, nil, ZP);
+	draw(dst, Rect(r.min.x+R, r.min.y+1, r.max.x-R, r.max.y-1), src, nil, sp);
+	draw(dst, Rect(r.min.x+1, r.min.y+R, r.max.x-1, r.max.y-R), src, nil, sp);
+	
+	/* The corners, clockwise from the top left */
+	c = corner_sprites[colorindex(src)];
+	draw(dst, Rect(r.min.x, r.min.y, r.min.x+R, r.min.y+R), c[0], corner_masks[0], ZP);
+	draw(dst, Rect(r.max.x-R, r.min.y, r.max.x, r.min.y+R), c[1], corner_masks[1], ZP);
+	draw(dst, Rect(r.max.x-R, r.max.y-R, r.max.x, r.max.y), c[2], corner_masks[2], ZP);
+	draw(dst, Rect(r.min.x, r.max.y-R, r.min.x+R, r.max.y), c[3], corner_masks[3], ZP);
 }
 
 void
 setupdraw(void)
 {
+	Font *oldfont;
+	
 	if(display == nil)
 		sysfatal("display not initialized");
 	
@@ -127,57 +290,140 @@ setupdraw(void)
 	if(screen == nil)
 		sysfatal("screen not initialized");
 	
+	oldfont = font;
 	font = display->defaultfont;
 	if(font == nil)
 		sysfatal("font not initialized");
+	if(root != nil && font != oldfont)
+		flushwidths();
 	
 	/* Initialize colors */
 	initcolors();
+	initsprites();
+	flushnodeimages();
 }
 
 /* Initialize the mindmap with a root node */
 void
 initmap(void)
 {
+	if((nodepool = poolcreate()) == nil)
+		sysfatal("%r");
+	layoutreset();
 	root = createnode("Main Topic", nil);
 	current = root;
 	layoutmap(root, 0);
 }
 
-/* Create a new node */
+/* Create a new node in the current map */
 Node*
 createnode(char *text, Node *parent)
 {
 	Node *n;
 	
-	n = malloc(sizeof(Node));
-	if(n == nil)
-		sysfatal("malloc failed: %r");
+	if((n = newnode(nodepool, text, parent)) == nil)
+		sysfatal("%r");
+	if(parent != nil) {
+		treestale();
+		journaladd(n);
+	}
+	markdirty(n);
+	return n;
+}
+
+/* Copy text into a node's space, or new space when it does not fit */
+static int
+copytext(Nodepool *pool, Node *node, char *text)
+{
+	char *s;
+	int n;
+	
+	node->width = 0;
+	n = strlen(text) + 1;
+	if(n > node->textcap) {
+		if((s = pooltext(pool, n)) == nil)
+			return -1;
+		node->text = s;
+		node->textcap = n;
+	}
+	memmove(node->text, text, n);
+	return 0;
+}
+
+/*
+ * Create a new node in a given pool, or return nil if there is no
+ * memory for it, as when a map read in is too big.
+ */
+Node*
+newnode(Nodepool *pool, char *text, Node *parent)
+{
+	Node *n;
 	
-	memset(n, 0, sizeof(Node));
-	strncpy(n->text, text, MAXTEXT-1);
-	n->text[MAXTEXT-1] = '\0';
+	if((n = poolalloc(pool)) == nil)
+		return nil;
+	n->text = "";
+	if(text != nil && text[0] != '\0' && copytext(pool, n, text) < 0) {
+		poolfree(pool, n);
+		return nil;
+	}
 	n->parent = parent;
-	n->nchildren = 0;
-	n->selected = 0;
 	
-	/* Add to parent's children if it has a parent */
-	if(parent != nil && parent->nchildren < MAXCHILDREN)
-		parent->children[parent->nchildren++] = n;
+	/* Add to the end of parent's children if it has a parent */
+	if(parent != nil) {
+		n->prev = parent->last;
+		if(parent->last != nil)
+			parent->last->next = n;
+		else
+			parent->child = n;
+		parent->last = n;
+		parent->nchildren++;
+	}
 	
 	return n;
 }
 
+/* Replace a node's text, reusing its space when it fits */
+void
+settext(Nodepool *pool, Node *node, char *text)
+{
+	if(copytext(pool, node, text) < 0)
+		sysfatal("%r");
+}
+
+/* Make sure a node's text has room for n bytes, terminator included */
+void
+growtext(Nodepool *pool, Node *node, int n)
+{
+	char *s;
+	int len;
+	
+	if(n <= node->textcap)
+		return;
+	
+	/* Leave slack so typing does not copy on every keystroke */
+	len = strlen(node->text) + 1;
+	if(n < 2*len)
+		n = 2*len;
+	if(n < 16)
+		n = 16;
+	if((s = pooltext(pool, n)) == nil)
+		sysfatal("%r");
+	memmove(s, node->text, len);
+	node->text = s;
+	node->textcap = n;
+}
+
 /* Add a child to a node */
 void
 addchild(Node *parent)
 {
 	Node *child;
 	
-	if(parent->nchildren >= MAXCHILDREN)
-		return;
+	/* New children go after any that are still unread */
+	expandnode(parent);
 	
 	child = createnode("", parent);  /* Start with empty text */
+	histadd(child);
 	current = child;
 	switchmode(INSERT);
 	
@@ -194,10 +440,8 @@ addsibling(Node *node)
 	if(node == root || node->parent == nil)  /* Can't add sibling to root */
 		return;
 	
-	if(node->parent->nchildren >= MAXCHILDREN)
-		return;
-	
 	sibling = createnode("", node->parent);  /* Start with empty text */
+	histadd(sibling);
 	current = sibling;
 	switchmode(INSERT);
 	
@@ -205,183 +449,574 @@ addsibling(Node *node)
 	layoutmap(root, 0);
 }
 
-/* Delete a node and its children */
+/* Delete a node and its children, holding them to undo */
 void
 deletenode(Node *node)
 {
-	int i;
-	
 	if(node == nil || node == root)
 		return;
-	
-	/* Recursively delete all children first */
-	for(i = 0; i < node->nchildren; i++)
-		deletenode(node->children[i]);
-	
-	/* Remove this node from parent's children */
-	if(node->parent != nil) {
-		for(i = 0; i < node->parent->nchildren; i++) {
-			if(node->parent->children[i] == node) {
-				/* Shift remaining children down */
-				while(i < node->parent->nchildren - 1) {
-					node->parent->children[i] = node->parent->children[i + 1];
-					i++;
-				}
-				node->parent->nchildren--;
-				break;
-			}
+	journaldel(node);
+	histdelete(node);
+}
+
+/* Unlink a node and its subtree from the map, leaving them whole */
+void
+detachnode(Node *node)
+{
+	Node *parent;
+	
+	if((parent = node->parent) != nil) {
+		if(node->prev != nil)
+			node->prev->next = node->next;
+		else
+			parent->child = node->next;
+		if(node->next != nil)
+			node->next->prev = node->prev;
+		else
+			parent->last = node->prev;
+		parent->nchildren--;
+	}
+	node->parent = nil;
+	node->prev = nil;
+	node->next = nil;
+	treestale();
+}
+
+/* Link a detached subtree back in under parent, after prev or first if nil */
+void
+attachnode(Node *node, Node *parent, Node *prev)
+{
+	node->parent = parent;
+	node->prev = prev;
+	node->next = prev != nil ? prev->next : parent->child;
+	if(prev != nil)
+		prev->next = node;
+	else
+		parent->child = node;
+	if(node->next != nil)
+		node->next->prev = node;
+	else
+		parent->last = node;
+	parent->nchildren++;
+	treestale();
+}
+
+/* Free a detached subtree, children first, each node once the walk has stepped off it */
+void
+freenode(Node *node)
+{
+	Treewalk w;
+	Node *n, *dead;
+	
+	dead = nil;
+	walkstart(&w, node);
+	while((n = walkstep(&w)) != nil) {
+		if(dead != nil)
+			poolfree(nodepool, dead);
+		dead = nil;
+		if(w.leaving) {
+			n->dirty = 0;  /* Drop it from any pending layout */
+			dead = n;
 		}
 	}
+	if(dead != nil)
+		poolfree(nodepool, dead);
+}
+
+/*
+ * Levels of detail.  Zoomed out at all, node text no longer fits,
+ * so nodes are drawn as plain boxes and lines straight.  From
+ * AGGZOOM on, a subtree that comes to less than AGGCELL pixels
+ * each way is drawn as one block, made of the AGGCELL squares it
+ * touches, and nothing inside it is looked at; however many nodes
+ * are in view, only so many blocks fit in the window.  The squares
+ * are fixed to the map rather than the window, so each part of the
+ * map comes out the same whichever damage it is drawn for.
+ */
+enum {
+	MAXZOOM = 16,  /* So that map coordinates of the window fit in an int */
+	AGGZOOM = 4,   /* First zoom drawing small subtrees as blocks */
+	AGGCELL = 8    /* Side of the squares blocks are made of */
+};
+
+/* Where point p of the map is drawn in the window */
+Point
+toscreen(Point p)
+{
+	return Pt((p.x >> zoom) - viewport.x, (p.y >> zoom) - viewport.y);
+}
+
+/* The pixels of the window that rectangle r of the map touches, at least one */
+Rectangle
+toscreenr(Rectangle r)
+{
+	int k;
 	
-	free(node);
+	k = (1 << zoom) - 1;
+	return Rect((r.min.x >> zoom) - viewport.x, (r.min.y >> zoom) - viewport.y,
+		((r.max.x + k) >> zoom) - viewport.x, ((r.max.y + k) >> zoom) - viewport.y);
+}
+
+/* The point of the map at the top left of pixel p of the window */
+Point
+tomap(Point p)
+{
+	return Pt((p.x + viewport.x) * (1 << zoom), (p.y + viewport.y) * (1 << zoom));
+}
+
+/* Note that a rectangle of the window must be drawn again */
+static void
+damagewin(Rectangle r)
+{
+	/* Lines and corners stray a pixel or so outside the bounds */
+	r = insetrect(r, -2);
+	if(ndamaged == NDAMAGE)
+		combinerect(&damaged[NDAMAGE-1], r);
+	else
+		damaged[ndamaged++] = r;
 }
 
-/* Calculate positions for nodes */
+/* Note that a rectangle of the map must be drawn again */
 void
-layoutmap(Node *node, int depth)
+damage(Rectangle r)
 {
-	int i, width;
-	static int xpos = 0;
-	static int level_height[100] = {0};  /* Heights for each level */
-	static int max_width = 0;  /* Track maximum width for centering */
-	
-	if(depth == 0) {
-		/* Root initialization */
-		memset(level_height, 0, sizeof(level_height));
-		xpos = MARGIN;  /* Remove dependency on maprect */
-		max_width = 0;
+	/* Far enough out, a change can grow or break up a block well beyond it */
+	if(zoom >= AGGZOOM) {
+		damageall();
+		return;
 	}
-	
-	/* Calculate node width */
-	width = nodewidth(node->text);
-	if(width < MINW)
-		width = MINW;
-	
-	/* Only position nodes that aren't manually placed */
-	if(!node->manual_pos) {
-		/* Position the node */
-		node->pos.x = xpos + depth * (width + HSPACE);
-		
-		if(depth > 0) {
-			/* Position vertically based on previous nodes at this level */
-			node->pos.y = MARGIN + level_height[depth];
-			level_height[depth] += NODEH + VSPACE;
-		} else {
-			/* Root node at a fixed position if not manually placed */
-			node->pos.y = MARGIN;
-		}
-		
-		/* Set bounds rectangle */
-		node->bounds = (Rectangle){
-			Pt(node->pos.x, node->pos.y),
-			Pt(node->pos.x + width, node->pos.y + NODEH)
-		};
+	damagewin(toscreenr(r));
+}
+
+/* Note that the whole window must be drawn again */
+void
+damageall(void)
+{
+	fulldamage = 1;
+}
+
+/* Damage the subtree under node i of the store, with the line in from its parent */
+void
+damagetree(int i)
+{
+	Rectangle r;
+
+	if(!tree.valid) {
+		damageall();
+		return;
 	}
+	r = tree.span[i];
+	if(tree.parent[i] >= 0)
+		combinerect(&r, tree.bounds[tree.parent[i]]);
+	damage(r);
+}
+
+/* Whether the subtree under node i of the store is drawn as a block */
+static int
+collapsed(int i)
+{
+	return zoom >= AGGZOOM
+		&& Dx(tree.span[i]) >> zoom < AGGCELL && Dy(tree.span[i]) >> zoom < AGGCELL;
+}
+
+/* The squares of the window a subtree drawn as a block covers */
+static Rectangle
+aggblock(Rectangle span)
+{
+	Rectangle r;
 	
-	/* Track maximum width */
-	if(node->pos.x + width > max_width)
-		max_width = node->pos.x + width;
+	r = rectaddpt(toscreenr(span), viewport);
+	r.min.x &= ~(AGGCELL-1);
+	r.min.y &= ~(AGGCELL-1);
+	r.max.x = (r.max.x + AGGCELL-1) & ~(AGGCELL-1);
+	r.max.y = (r.max.y + AGGCELL-1) & ~(AGGCELL-1);
+	return rectsubpt(r, viewport);
+}
+
+/* The part of the map being drawn, taking in blocks that reach into it */
+static Rectangle
+mapview(void)
+{
+	Rectangle r;
 	
-	/* Layout all children */
-	for(i = 0; i < node->nchildren; i++) {
-		layoutmap(node->children[i], depth + 1);
+	r = drawclip;
+	if(zoom >= AGGZOOM)
+		r = insetrect(r, -AGGCELL);
+	return Rpt(tomap(r.min), tomap(r.max));
+}
+
+/*
+ * Connection lines are cubic curves, flattened into polylines the
+ * first time they are drawn and kept in a table hashed on their
+ * ends, so a curve is worked out again only once a node at one
+ * end or the other has moved, or another curve has taken its slot.
+ * Nodes coming and going leave the other curves where they were.
+ */
+enum {
+	NEDGE = 4096,  /* Curves kept flattened, a power of two */
+	MAXSEG = 32    /* Most segments a curve is flattened into */
+};
+
+typedef struct Edge {
+	Point from;
+	Point to;
+	int n;  /* Points, 0 while the slot is empty */
+	Point pt[MAXSEG+1];
+} Edge;
+
+static Edge edges[NEDGE];
+static Point *linepts;  /* Polyline being built by drawlines */
+static int nlinepts;
+static int linecap;
+static Point *dotpts;  /* Ends of its lines at the children */
+static int ndotpts;
+static int dotcap;
+
+/* The curve from a point of the map to another */
+static Edge*
+flatten(Point from, Point to)
+{
+	Edge *e;
+	double t, u, y1, y2;
+	uint h;
+	int k, n;
+	
+	h = (uint)from.x*0x9E3779B1 ^ (uint)from.y*0x85EBCA77
+		^ (uint)to.x*0xC2B2AE3D ^ (uint)to.y*0x27D4EB2F;
+	e = &edges[(h ^ h>>16) & (NEDGE-1)];
+	if(e->n > 0 && eqpt(e->from, from) && eqpt(e->to, to))
+		return e;
+	
+	/* Control points below the start and above the end, a third of the way down each */
+	y1 = from.y + (to.y - from.y)/3;
+	y2 = from.y + 2*(to.y - from.y)/3;
+	n = (abs(to.x - from.x) + abs(to.y - from.y)) / 8;
+	if(n < 2)
+		n = 2;
+	if(n > MAXSEG)
+		n = MAXSEG;
+	for(k = 0; k <= n; k++) {
+		t = (double)k / n;
+		u = 1 - t;
+		e->pt[k].x = floor(u*u*(u + 3*t)*from.x + t*t*(3*u + t)*to.x + 0.5);
+		e->pt[k].y = floor(u*u*u*from.y + 3*u*u*t*y1 + 3*u*t*t*y2 + t*t*t*to.y + 0.5);
 	}
+	e->from = from;
+	e->to = to;
+	e->n = n+1;
+	return e;
 }
 
-/* Draw all connection lines in the tree */
+static void
+addlinept(Point p)
+{
+	if(nlinepts == linecap) {
+		linecap = linecap ? 2*linecap : 1024;
+		linepts = realloc(linepts, linecap*sizeof(Point));
+		if(linepts == nil)
+			sysfatal("realloc failed: %r");
+	}
+	linepts[nlinepts++] = p;
+}
+
+static void
+adddotpt(Point p)
+{
+	if(ndotpts == dotcap) {
+		dotcap = dotcap ? 2*dotcap : 256;
+		dotpts = realloc(dotpts, dotcap*sizeof(Point));
+		if(dotpts == nil)
+			sysfatal("realloc failed: %r");
+	}
+	dotpts[ndotpts++] = p;
+}
+
+/* Draw the dot sprite over the end of a line at p in the window */
+static void
+drawdot(Point p)
+{
+	draw(canvas, rectaddpt(Rect(0, 0, CONN, CONN), subpt(p, Pt(CONN/2, CONN/2))),
+		conn_dots[colorindex(bord)], conn_mask, ZP);
+}
+
+/*
+ * Draw all connection lines in the tree, one per node below the
+ * top.  The lines out of a node are drawn together as one polyline,
+ * running out to each child and back, in a single call.
+ */
 void
 drawlines(Node *node)
 {
-	int i;
+	Rectangle *pb, *cb, view, r;
+	Point from, to, last;
+	Edge *e;
+	int p, c, k, end;
 	
-	if(node == nil)
+	if(node == nil || collapsed(node->idx))
 		return;
 	
-	/* Draw connecting lines to children */
-	for(i = 0; i < node->nchildren; i++) {
-		Point from, to;
+	/*
+	 * A line lies between its parent's bounds and the child's, so
+	 * the line into a subtree and all the lines in it lie within
+	 * the subtree's span taken together with the parent's bounds,
+	 * and the lines out of a node and below it within its span.
+	 */
+	view = mapview();
+	end = tree.end[node->idx];
+	for(p = node->idx; p < end; p++) {
+		/* The lines inside a block are covered by it */
+		if(!rectXrect(tree.span[p], view) || (p > node->idx && collapsed(p))) {
+			p = tree.end[p] - 1;
+			continue;
+		}
+		if(tree.end[p] == p+1)
+			continue;
 		
-		from.x = node->bounds.min.x + (node->bounds.max.x - node->bounds.min.x) / 2;
-		from.y = node->bounds.max.y;
+		pb = &tree.bounds[p];
+		from.x = pb->min.x + (pb->max.x - pb->min.x) / 2;
+		from.y = pb->max.y;
 		
-		to.x = node->children[i]->bounds.min.x + 
-			(node->children[i]->bounds.max.x - node->children[i]->bounds.min.x) / 2;
-		to.y = node->children[i]->bounds.min.y;
+		nlinepts = 0;
+		ndotpts = 0;
+		last = Pt(-1, -1);
+		for(c = p+1; c < tree.end[p]; c = tree.end[c]) {
+			cb = &tree.bounds[c];
+			r = tree.span[c];
+			combinerect(&r, *pb);
+			if(!rectXrect(r, view))
+				continue;
+			
+			to.x = cb->min.x + (cb->max.x - cb->min.x) / 2;
+			to.y = cb->min.y;
+			
+			if(zoom == 0) {
+				/* Out along the curve and back, with a dot sprite at the child's end */
+				e = flatten(from, to);
+				if(nlinepts == 0)
+					addlinept(subpt(e->pt[0], viewport));
+				for(k = 1; k < e->n; k++)
+					addlinept(subpt(e->pt[k], viewport));
+				for(k = e->n-2; k >= 0; k--)
+					addlinept(subpt(e->pt[k], viewport));
+				adddotpt(subpt(to, viewport));
+			} else {
+				/* Zoomed out, straight, and once for siblings packed closer than a pixel */
+				to = toscreen(to);
+				if(eqpt(to, last))
+					continue;
+				if(nlinepts == 0)
+					addlinept(toscreen(from));
+				addlinept(to);
+				addlinept(toscreen(from));
+				last = to;
+			}
+		}
+		if(nlinepts == 0)
+			continue;
 		
-		drawconnection(from, to, 1, bord);  /* Always use 1px lines */
-	}
-	
-	/* Recursively draw lines for children */
-	for(i = 0; i < node->nchildren; i++) {
-		drawlines(node->children[i]);
+		if(zoom == 0) {
+			poly(canvas, linepts, nlinepts, Endsquare, Endsquare, 1, bord, ZP);  /* Always use 1px lines */
+			
+			/* The dots go over the lines, as they did one line at a time */
+			for(k = 0; k < ndotpts; k++)
+				drawdot(dotpts[k]);
+			drawdot(subpt(from, viewport));
+		} else
+			poly(canvas, linepts, nlinepts, Endsquare, Endsquare, 0, bord, ZP);
 	}
 }
 
-/* Draw a node and its children */
+/* Draw a node zoomed out, as a box in its colors */
+static void
+drawbox(Rectangle r, Image *bg)
+{
+	draw(canvas, r, bord, nil, ZP);
+	if(Dx(r) > 2 && Dy(r) > 2)
+		draw(canvas, insetrect(r, 1), bg, nil, ZP);
+}
+
+/* Draw a node and its children, parents before children */
 void
 drawnode(Node *node)
 {
-	int i;
-	Rectangle r;
-	Point txtp;
-	Image *bg, *fg;
-	int depth = 0;
-	Node *p;
-	int style = 0;
+	Node *n;
+	Rectangle r, view, block;
+	Image *bg, *fg, *img;
+	int i, end;
 	
 	if(node == nil)
 		return;
 	
-	/* Calculate node depth */
-	for(p = node->parent; p != nil; p = p->parent)
-		depth++;
-	
-	r = node->bounds;
-	
-	/* Apply viewport offset to bounds */
-	r.min.x -= viewport.x;
-	r.min.y -= viewport.y;
-	r.max.x -= viewport.x;
-	r.max.y -= viewport.y;
+	view = mapview();
+	block = ZR;
+	end = tree.end[node->idx];
+	for(i = node->idx; i < end; i++) {
+		n = tree.node[i];
+		
+		/* Skip everything under a node whose whole subtree is outside the part being drawn */
+		if(!rectXrect(tree.span[i], view)) {
+			i = tree.end[i] - 1;
+			continue;
+		}
+		
+		/* A small enough subtree is one block, drawn once for a run of siblings in it */
+		if(collapsed(i)) {
+			r = aggblock(tree.span[i]);
+			if(!eqrect(r, block))
+				draw(canvas, r, pale, nil, ZP);
+			block = r;
+			i = tree.end[i] - 1;
+			continue;
+		}
+		
+		/* Skip just the node if it is outside, as its children may not be */
+		if(!rectXrect(tree.bounds[i], view))
+			continue;
+		r = toscreenr(tree.bounds[i]);
+		
+		/* Select colors based on node state and depth */
+		if(n == current) {
+			bg = bord;
+			fg = back;
+		} else if(n == root) {
+			bg = high;
+			fg = text;
+		} else {
+			bg = tree.depth[i] % 2 ? pale : back;
+			fg = text;
+		}
+		
+		/* Copy the node in from its rendered image, drawing it afresh only if it has none */
+		if(zoom > 0) {
+			drawbox(r, bg);
+			block = ZR;
+		} else if((img = nodeimage(n->text, Dx(r), bg, fg)) != nil)
+			draw(canvas, r, img, nil, ZP);
+		else
+			rendernode(canvas, r, bg, fg, n->text);
+		
+		/* Read in children that have come into view; they show up next pass */
+		if(n->stub) {
+			expandnode(n);
+			nexpanded++;
+		}
+	}
+}
+
+/* Zoom to z, keeping the part of the map at p in the window where it is */
+void
+setzoom(int z, Point p)
+{
+	Point m;
 	
-	/* Skip if completely outside window bounds */
-	if(r.max.x <= screen->r.min.x || r.min.x >= screen->r.max.x ||
-	   r.max.y <= screen->r.min.y || r.min.y >= screen->r.max.y)
+	if(z < 0)
+		z = 0;
+	if(z > MAXZOOM)
+		z = MAXZOOM;
+	if(z == zoom)
 		return;
 	
-	/* Select colors based on node state and depth */
-	if(node == current) {
-		bg = bord;
-		fg = back;
-	} else if(node == root) {
-		bg = high;
-		fg = text;
-	} else {
-		bg = depth % 2 ? pale : back;
-		fg = text;
+	m = tomap(p);
+	zoom = z;
+	viewport = subpt(Pt(m.x >> zoom, m.y >> zoom), p);
+	damageall();
+}
+
+/* Draw the status line if its text has changed, or regardless if force is set */
+int
+drawstatus(Rectangle winr, int force)
+{
+	static char lastleft[512], last[256];
+	char left[512], buf[256], *modestr;
+	Rectangle statusr;
+	int n;
+	
+	/* Mode and canvas drag status on left side */
+	switch(mode) {
+		case NORMAL: modestr = "NORMAL"; break;
+		case INSERT: modestr = "INSERT"; break;
+		case DRAGGING: modestr = "DRAGGING"; break;
+		case CANVAS_DRAG: modestr = panning ? "CANVAS DRAG (active)" : "CANVAS DRAG"; break;
+		default: modestr = "UNKNOWN"; break;
 	}
 	
-	/* Draw node with bezier corners */
-	roundedrect(screen, r, bg, ZP, style);
-	
-	/* Draw node text if there's room */
-	if(r.max.x - r.min.x > 2*PADDING) {
-		txtp.x = r.min.x + PADDING;
-		txtp.y = r.min.y + (NODEH - font->height) / 2;
-		string(screen, txtp, fg, ZP, font, node->text);
+	/* Then how the job under way or the last one is going */
+	n = snprint(left, sizeof(left), "%s", modestr);
+	if(job != nil)
+		snprint(left+n, sizeof(left)-n, "  %s %s: %lud nodes",
+			job->writing ? "writing" : "reading", job->name,
+			job->writing ? job->pool->nwritten : job->pool->nused);
+	else if(jobmsg[0] != '\0')
+		snprint(left+n, sizeof(left)-n, "  %s", jobmsg);
+	
+	/* Version and coordinates on right side, after any pool statistics */
+	n = 0;
+	if(showstats) {
+		poolstats(nodepool, buf, sizeof(buf));
+		n = strlen(buf);
+		n += snprint(buf+n, sizeof(buf)-n, "  ");
 	}
+	n += snprint(buf+n, sizeof(buf)-n, "mindthemap 0.1 [%d,%d]", viewport.x, viewport.y);
+	if(zoom > 0)
+		snprint(buf+n, sizeof(buf)-n, " 1/%d", 1 << zoom);
+	
+	if(!force && strcmp(left, lastleft) == 0 && strcmp(buf, last) == 0)
+		return 0;
+	strecpy(lastleft, lastleft+sizeof(lastleft), left);
+	strecpy(last, last+sizeof(last), buf);
+	
+	/* Draw status line at bottom of window */
+	statusr = Rect(winr.min.x, winr.max.y - font->height - 5,
+		winr.max.x, winr.max.y - 5);
+	draw(canvas, statusr, bord, nil, ZP);
+	string(canvas, Pt(statusr.min.x + 5, statusr.min.y), back, ZP, font, left);
+	string(canvas, Pt(statusr.max.x - stringwidth(font, buf) - 5, statusr.min.y),
+		back, ZP, font, buf);
+	draw(screen, statusr, canvas, nil, statusr.min);
+	return 1;
+}
+
+/*
+ * Pan the map by d.  What is still in view is moved across in the
+ * canvas rather than drawn again, leaving only the strips that come
+ * into view along the edges to be drawn.
+ */
+void
+scrollmap(Point d)
+{
+	Rectangle r;
+	int i;
+	
+	viewport = addpt(viewport, d);
+	
+	/* Damage not yet drawn moves with the map */
+	for(i = 0; i < ndamaged; i++)
+		damaged[i] = rectsubpt(damaged[i], d);
 	
-	/* Draw children after parent */
-	for(i = 0; i < node->nchildren; i++) {
-		drawnode(node->children[i]);
+	if(canvas == nil || fulldamage || abs(d.x) >= Dx(maprect) || abs(d.y) >= Dy(maprect)) {
+		damageall();
+		return;
 	}
+	
+	draw(canvas, maprect, canvas, nil, addpt(maprect.min, d));
+	scrolled = 1;
+	
+	r = maprect;
+	if(d.x > 0)
+		damagewin(Rect(r.max.x - d.x, r.min.y, r.max.x, r.max.y));
+	else if(d.x < 0)
+		damagewin(Rect(r.min.x, r.min.y, r.min.x - d.x, r.max.y));
+	if(d.y > 0)
+		damagewin(Rect(r.min.x, r.max.y - d.y, r.max.x, r.max.y));
+	else if(d.y < 0)
+		damagewin(Rect(r.min.x, r.min.y, r.max.x, r.min.y - d.y));
 }
 
 void
 drawmap(void)
 {
-	Rectangle winr;
-	char buf[128];
+	Rectangle winr, r;
+	int i, drawn, status;
 	
 	if(screen == nil || display == nil)
 		return;
@@ -389,112 +1024,96 @@ drawmap(void)
 	/* Get the actual window rectangle */
 	winr = screen->r;
 	
-	/* Clear entire window first */
-	draw(screen, winr, back, nil, ZP);
+	/* Set maprect to window bounds, leaving room for status line */
+	maprect = winr;
+	maprect.max.y -= font->height + 5;
+	
+	/* A new window size needs a new canvas */
+	if(canvas == nil || !eqrect(canvas->r, winr)) {
+		freeimage(canvas);
+		canvas = allocimage(display, winr, screen->chan, 0, DNofill);
+		if(canvas == nil)
+			sysfatal("allocimage failed: %r");
+		damageall();
+	}
 	
-	if(root != nil) {
-		/* Set maprect to window bounds */
-		maprect = winr;
-		
-		/* Leave room for status line */
-		maprect.max.y -= font->height + 5;
+	/* Go round again while stubs in view are still being read in */
+	nodeimageframe();
+	drawn = status = 0;
+	do {
+		nexpanded = 0;
 		
-		/* Recalculate layout before drawing */
-		layoutmap(root, 0);
-		
-		/* First draw all connection lines */
-		drawlines(root);
-		
-		/* Then draw all nodes on top */
-		drawnode(root);
-		
-		/* Draw status line at bottom of window */
-		Rectangle statusr = Rect(winr.min.x, winr.max.y - font->height - 5,
-			winr.max.x, winr.max.y - 5);
-		draw(screen, statusr, bord, nil, ZP);
+		/* Recalculate layout first, as it notes where nodes have moved */
+		if(root != nil)
+			layoutmap(root, 0);
 		
-		/* Draw mode and canvas drag status on left side */
-		char *modestr;
-		switch(mode) {
-			case NORMAL: modestr = "NORMAL"; break;
-			case INSERT: modestr = "INSERT"; break;
-			case DRAGGING: modestr = "DRAGGING"; break;
-			case CANVAS_DRAG: modestr = panning ? "CANVAS DRAG (active)" : "CANVAS DRAG"; break;
-			default: modestr = "UNKNOWN"; break;
+		if(fulldamage) {
+			fulldamage = 0;
+			ndamaged = 0;
+			damaged[ndamaged++] = maprect;
+			replclipr(canvas, 0, winr);
+			draw(canvas, winr, back, nil, ZP);
+			scrolled = 1;
+			status = 1;
 		}
-		string(screen, Pt(statusr.min.x + 5, statusr.min.y), back, ZP, font, modestr);
 		
-		/* Draw version and coordinates on right side */
-		snprint(buf, sizeof(buf), "mindthemap 0.1 [%d,%d]", viewport.x, viewport.y);
-		string(screen, Pt(statusr.max.x - stringwidth(font, buf) - 5, statusr.min.y),
-			back, ZP, font, buf);
+		/* Clear and repaint each damaged part: connection lines, then nodes on top */
+		for(i = 0; i < ndamaged; i++) {
+			r = damaged[i];
+			if(!rectinrect(r, maprect))
+				status = 1;
+			if(!rectclip(&r, maprect))
+				continue;
+			drawclip = insetrect(r, -2);  /* Take in what strays over from just outside */
+			replclipr(canvas, 0, r);
+			draw(canvas, r, back, nil, ZP);
+			if(root != nil) {
+				drawlines(root);
+				drawnode(root);
+			}
+			if(!scrolled)
+				draw(screen, r, canvas, nil, r.min);
+			drawn = 1;
+		}
+		ndamaged = 0;
+	} while(nexpanded > 0);
+	replclipr(canvas, 0, winr);
+	
+	/* After a scroll the whole map has moved on screen */
+	if(scrolled) {
+		draw(screen, winr, canvas, nil, winr.min);
+		scrolled = 0;
+		drawn = 1;
 	}
 	
-	flushimage(display, 1);
-}
-
-/* Draw connection between nodes with bezier curves */
-void
-drawconnection(Point from, Point to, int thickness, Image *color)
-{
-	Point p[4];
-	int dy = to.y - from.y;
-	
-	/* Apply viewport offset to points */
-	from.x -= viewport.x;
-	from.y -= viewport.y;
-	to.x -= viewport.x;
-	to.y -= viewport.y;
-	
-	/* Only draw if both points are within bounds */
-	if(from.x < maprect.min.x || from.x >= maprect.max.x ||
-	   from.y < maprect.min.y || from.y >= maprect.max.y ||
-	   to.x < maprect.min.x || to.x >= maprect.max.x ||
-	   to.y < maprect.min.y || to.y >= maprect.max.y)
-		return;
-	
-	/* Calculate control points for a smooth curve */
-	p[0] = from;
-	p[1] = Pt(from.x, from.y + dy/3);  /* First control point at 1/3 distance */
-	p[2] = Pt(to.x, from.y + 2*dy/3);  /* Second control point at 2/3 distance */
-	p[3] = to;
+	if(root != nil && drawstatus(winr, status))
+		drawn = 1;
 	
-	/* Draw the bezier curve */
-	bezier(screen, p[0], p[1], p[2], p[3], Enddisc, Enddisc, thickness, color, ZP);
+	if(drawn)
+		flushimage(display, 1);
 }
 
 /* Handle vim-like navigation */
 void
 navigate(Rune key)
 {
-	int i, idx = -1;
-	
-	/* Find current node's index within parent */
-	if(current->parent != nil) {
-		for(i = 0; i < current->parent->nchildren; i++) {
-			if(current->parent->children[i] == current) {
-				idx = i;
-				break;
-			}
-		}
-	}
-	
 	switch(key) {
 	case 'h':  /* Move to parent */
 		if(current->parent != nil)
 			current = current->parent;
 		break;
 	case 'j':  /* Move down to next sibling */
-		if(current->parent != nil && idx >= 0 && idx < current->parent->nchildren - 1)
-			current = current->parent->children[idx + 1];
+		if(current->next != nil)
+			current = current->next;
 		break;
 	case 'k':  /* Move up to previous sibling */
-		if(current->parent != nil && idx > 0)
-			current = current->parent->children[idx - 1];
+		if(current->prev != nil)
+			current = current->prev;
 		break;
 	case 'l':  /* Move to first child */
-		if(current->nchildren > 0)
-			current = current->children[0];
+		expandnode(current);
+		if(current->child != nil)
+			current = current->child;
 		break;
 	}
 }
@@ -503,8 +1122,12 @@ navigate(Rune key)
 void
 switchmode(int newmode)
 {
-	mode = newmode;
-	drawmap();  /* Redraw to update status line */
+	/* What is typed in one go is undone in one go */
+	if(newmode == INSERT && mode != INSERT)
+		histtext(current);
+	else if(newmode != INSERT && mode == INSERT)
+		histtextdone();
+	mode = newmode;  /* The status line shows it in the next frame */
 }
 
 /* Handle keypresses */
@@ -529,13 +1152,11 @@ handlekey(Rune key, Event *ev)
 		case '\t':  /* Add child to current node */
 			if(mode == NORMAL) {
 				addchild(current);
-				drawmap();
 			}
 			break;
 		case '\n':  /* Add sibling to current node */
 			if(mode == NORMAL) {
 				addsibling(current);
-				drawmap();
 			}
 			break;
 		case 'd':  /* Delete current node */
@@ -543,17 +1164,24 @@ handlekey(Rune key, Event *ev)
 				Node *parent = current->parent;
 				deletenode(current);
 				current = parent;
-				layoutmap(root, 0);
-				drawmap();
 			}
 			break;
+		case 'u':  /* Undo */
+			if(mode == NORMAL)
+				undo();
+			break;
+		case 0x12:  /* ^R: redo */
+			if(mode == NORMAL)
+				redo();
+			break;
 		case 'h':
 		case 'j':
 		case 'k':
 		case 'l':
 			if(mode == NORMAL) {
+				damage(current->bounds);
 				navigate(key);
-				drawmap();
+				damage(current->bounds);
 			}
 			break;
 		case 'q':  /* Quit command */
@@ -566,8 +1194,16 @@ handlekey(Rune key, Event *ev)
 				buf[1] = 0;
 				if (eenter("Cmd", buf, sizeof(buf), &ev->mouse) > 0)
 					handlecmd(buf);
+				damageall();  /* Commands may print over the window */
 			}
 			break;
+		case '+':  /* Zoom in */
+		case '=':
+			setzoom(zoom - 1, divpt(addpt(maprect.min, maprect.max), 2));
+			break;
+		case '-':  /* Zoom out */
+			setzoom(zoom + 1, divpt(addpt(maprect.min, maprect.max), 2));
+			break;
 		case ' ':  /* Toggle canvas drag mode */
 			if(mode == NORMAL)
 				switchmode(CANVAS_DRAG);
@@ -577,21 +1213,36 @@ handlekey(Rune key, Event *ev)
 		}
 	} else if(mode == INSERT) {
 		int len = strlen(current->text);
+		int n;
+		Rune r;
 		
+		/* A measured width is kept up to date by measuring just the rune that changes */
 		if(key == '\n' || key == Kesc) {
 			/* Exit insert mode */
 			switchmode(NORMAL);
 		} else if(key == '\b') {
-			/* Backspace */
+			/* Backspace over the last rune, however many bytes it takes */
 			if(len > 0) {
-				current->text[len - 1] = '\0';
-				drawmap();  /* Redraw after text change */
+				growtext(nodepool, current, len + 1);  /* Text may be shared */
+				for(n = len - 1; n > 0 && (current->text[n] & 0xC0) == 0x80; n--)
+					;
+				if(current->width > 0) {
+					chartorune(&r, current->text + n);
+					current->width -= runestringnwidth(font, &r, 1);
+				}
+				current->text[n] = '\0';
+				markdirty(current);
+				journaltext(current);
 			}
-		} else if(len < MAXTEXT - 1 && key >= ' ' && key < Runemax) {
+		} else if(len + UTFmax < MAXTEXT && key >= ' ' && key < Runemax) {
 			/* Add character */
-			current->text[len] = key;
-			current->text[len + 1] = '\0';
-			drawmap();  /* Redraw after text change */
+			growtext(nodepool, current, len + UTFmax + 1);
+			n = runetochar(current->text + len, &key);
+			current->text[len + n] = '\0';
+			if(current->width > 0)
+				current->width += runestringnwidth(font, &key, 1);
+			markdirty(current);
+			journaltext(current);
 		}
 	}
 }
@@ -601,6 +1252,7 @@ resdraw(void)
 {
 	if(getwindow(display, Refnone) < 0)
 		sysfatal("getwindow: %r");
+	damageall();
 	drawmap();
 }
 
@@ -609,13 +1261,14 @@ eresized(int new)
 {
 	if(new && getwindow(display, Refnone) < 0)
 		sysfatal("can't reattach to window");
+	damageall();
 	drawmap();
 }
 
 void
 usage(void)
 {
-	fprint(2, "usage: %s [file]\n", argv0);
+	fprint(2, "usage: %s [-ls] [-c kbytes] [-f fps] [-j] [-u kbytes] [file]\n", argv0);
 	exits("usage");
 }
 
@@ -623,27 +1276,14 @@ usage(void)
 Node*
 findnode(Node *node, Point p)
 {
-	Node *found;
-	int i;
-	
 	if(node == nil)
 		return nil;
 	
-	/* Apply viewport offset to point for hit testing */
-	Point test = addpt(p, viewport);
-	
-	/* Check children first (reverse order for top-to-bottom hit testing) */
-	for(i = node->nchildren - 1; i >= 0; i--) {
-		found = findnode(node->children[i], p);
-		if(found != nil)
-			return found;
-	}
-	
-	/* Check if point is within this node's bounds */
-	if(ptinrect(test, node->bounds))
-		return node;
+	/* Edits may have come in since the last frame; place them first */
+	layoutmap(root, 0);
 	
-	return nil;
+	/* Find the point in the map, then look only in its grid cell */
+	return treefind(tomap(p), node->idx, tree.end[node->idx]);
 }
 
 /* Snap point to grid */
@@ -666,86 +1306,123 @@ updatedrag(Node *node, Point mouse)
 		return;
 	
 	/* Calculate new position based on mouse and drag offset */
-	newpos = addpt(addpt(mouse, viewport), node->drag_offset);
+	newpos = addpt(tomap(mouse), drag_offset);
 	
 	/* Snap to grid */
 	newpos = snaptoGrid(newpos);
 	
 	/* Calculate new bounds */
-	width = nodewidth(node->text);
+	width = measurenode(node);
 	if(width < MINW)
 		width = MINW;
 	
-	/* Update node position and bounds */
+	/* It leaves its parent's tidy tree the first time, and then takes its own subtree along */
+	if(!node->manual_pos)
+		layoutreshape();
+	markdirty(node);
+	
+	/* Update node position and bounds, damaging the window where it was and is */
+	treeupdate(root);
+	damagetree(node->idx);
 	node->pos = newpos;
-	node->bounds = (Rectangle){
+	setbounds(node, (Rectangle){
 		Pt(newpos.x, newpos.y),
 		Pt(newpos.x + width, newpos.y + NODEH)
-	};
+	});
+	damagetree(node->idx);
 	
 	node->manual_pos = 1;  /* Mark as manually positioned */
 }
 
-/* Save node and its children to file */
-void
-savenode(int fd, Node *node)
+/* Save node and its children to file, counting them off in pool->nwritten */
+int
+savenode(Biobuf *bp, Nodepool *pool, Node *node)
 {
-	int i;
-	char buf[MAXTEXT + 256];  /* text + metadata */
+	Treewalk w;
+	Node *n;
 	
-	if(node == nil)
-		return;
+	/* The file is the subtree in preorder */
+	walkstart(&w, node);
+	while((n = walkstep(&w)) != nil) {
+		if(w.leaving)
+			continue;
+		
+		/* Format: "NODE text x y manual_pos nchildren\n" */
+		if(Bprint(bp, "NODE %s %d %d %d %d\n",
+			n->text,
+			n->pos.x,
+			n->pos.y,
+			n->manual_pos,
+			nodechildren(pool, n)) < 0)
+			return -1;
+		pool->nwritten++;
+		
+		/* Children not read in yet come straight from the lazy map */
+		if(n->stub && savestub(bp, pool, n) < 0)
+			return -1;
+	}
+	
+	return 0;
+}
+
+/* Save a whole map held in pool to an open file descriptor through a large buffer */
+int
+savefd(int fd, Nodepool *pool, Node *node, int binary)
+{
+	Biobuf bio;
+	uchar *buf;
+	int r;
 	
-	/* Format: "NODE text x y manual_pos nchildren\n" */
-	snprint(buf, sizeof(buf), "NODE %s %d %d %d %d\n",
-		node->text,
-		node->pos.x,
-		node->pos.y,
-		node->manual_pos,
-		node->nchildren);
+	buf = malloc(IOBUF);
+	if(buf == nil) {
+		werrstr("out of memory");
+		return -1;
+	}
 	
-	/* Write node data */
-	if(write(fd, buf, strlen(buf)) < 0)
-		sysfatal("write failed: %r");
+	Binits(&bio, fd, OWRITE, buf, IOBUF);
+	if(binary)
+		r = savebin(&bio, pool, node);
+	else
+		r = savenode(&bio, pool, node);
+	if(Bterm(&bio) < 0)
+		r = -1;
+	free(buf);
 	
-	/* Recursively save children */
-	for(i = 0; i < node->nchildren; i++)
-		savenode(fd, node->children[i]);
+	return r;
 }
 
-/* Load node from file */
-Node*
-loadnode(int fd, Node *parent)
+/*
+ * Read one node record under parent into *np, noting how many children
+ * follow it.  Returns 1 if it was read, 0 if there is no record to be
+ * read, and -1 if there is no memory for the node.
+ */
+static int
+readnode(Biobuf *bp, Nodepool *pool, Node *parent, Node **np, int *nchildren)
 {
-	char buf[MAXTEXT + 256];
+	char *buf;
 	char *toks[8];
 	Node *node;
-	int ntok, x, y, manual, nchildren;
-	int i, textlen, width;
+	int ntok, x, y, manual;
+	int i, len, textlen;
 	char *text, *p;
 	
-	/* Read a line */
-	for(i = 0; i < sizeof(buf)-1; i++) {
-		if(read(fd, buf+i, 1) != 1)
-			return nil;
-		if(buf[i] == '\n') {
-			buf[i+1] = '\0';
-			break;
-		}
-	}
-	buf[sizeof(buf)-1] = '\0';
+	/* Read a line straight out of the buffer */
+	if((buf = Brdline(bp, '\n')) == nil)
+		return 0;
+	len = Blinelen(bp);
+	buf[len-1] = '\0';
 	
 	/* Parse node data */
 	if(strncmp(buf, "NODE ", 5) != 0)
-		return nil;
+		return 0;
 	
 	/* Find the last four space-separated numbers */
-	p = buf + strlen(buf);
+	p = buf + len - 1;
 	for(i = 0; i < 4; i++) {
 		while(p > buf && p[-1] != ' ')
 			p--;
 		if(p <= buf)
-			return nil;
+			return 0;
 		p--;
 	}
 	p++;
@@ -753,9 +1430,9 @@ loadnode(int fd, Node *parent)
 	/* Parse the numbers */
 	ntok = tokenize(p, toks, 4);
 	if(ntok != 4)
-		return nil;
+		return 0;
 	
-	nchildren = atoi(toks[3]);
+	*nchildren = atoi(toks[3]);
 	manual = atoi(toks[2]);
 	y = atoi(toks[1]);
 	x = atoi(toks[0]);
@@ -763,75 +1440,505 @@ loadnode(int fd, Node *parent)
 	/* Extract text (everything between "NODE " and the numbers) */
 	textlen = p - (buf + 5);
 	if(textlen <= 0)
-		return nil;
+		return 0;
 	
 	text = buf + 5;
 	text[textlen-1] = '\0';  /* Remove trailing space */
 	
 	/* Create node */
-	node = createnode(text, parent);
+	if((node = newnode(pool, text, parent)) == nil)
+		return -1;
 	node->pos.x = x;
 	node->pos.y = y;
 	node->manual_pos = manual;
 	
-	/* Set bounds for manually positioned nodes */
-	if(manual) {
-		width = nodewidth(text);
-		if(width < MINW)
-			width = MINW;
-		node->bounds = (Rectangle){
-			Pt(x, y),
-			Pt(x + width, y + NODEH)
-		};
+	/* The layout works out the bounds */
+	*np = node;
+	return 1;
+}
+
+/*
+ * Load a node and the subtree under it from file.  The records are
+ * in preorder, so the nodes still waiting on children are kept on
+ * a stack, on the heap as maps can run thousands of levels deep.
+ * A record that cannot be read ends its parent's children.  Returns
+ * nil with the error string set if the first record cannot be read
+ * or memory runs out, leaving what was built in pool.
+ */
+Node*
+loadnode(Biobuf *bp, Nodepool *pool, Node *parent)
+{
+	Node *top, *n, **open;
+	int *left, nc, sp, cap, r;
+	void *v;
+	
+	if((r = readnode(bp, pool, parent, &top, &nc)) <= 0) {
+		if(r == 0)
+			werrstr("invalid file format");
+		return nil;
 	}
 	
-	/* Load children */
-	for(i = 0; i < nchildren; i++) {
-		if(loadnode(fd, node) == nil)
-			break;
+	cap = 64;
+	open = malloc(cap*sizeof(open[0]));
+	left = malloc(cap*sizeof(left[0]));
+	if(open == nil || left == nil) {
+		top = nil;
+		werrstr("out of memory");
+		goto out;
+	}
+	open[0] = top;
+	left[0] = nc;
+	sp = 1;
+	while(sp > 0) {
+		if(left[sp-1] <= 0) {
+			sp--;
+			continue;
+		}
+		left[sp-1]--;
+		if((r = readnode(bp, pool, open[sp-1], &n, &nc)) <= 0) {
+			if(r < 0) {
+				top = nil;
+				break;
+			}
+			sp--;
+			continue;
+		}
+		if(sp == cap) {
+			/* Each is kept on failure, to be freed below */
+			if((v = realloc(open, 2*cap*sizeof(open[0]))) != nil)
+				open = v;
+			if(v == nil || (v = realloc(left, 2*cap*sizeof(left[0]))) == nil) {
+				top = nil;
+				werrstr("out of memory");
+				break;
+			}
+			left = v;
+			cap *= 2;
+		}
+		open[sp] = n;
+		left[sp] = nc;
+		sp++;
+	}
+out:
+	free(open);
+	free(left);
+	
+	return top;
+}
+
+/*
+ * Load a whole map from an open file descriptor through a large buffer,
+ * allocating it from pool.  If lazy is set a binary map may come back
+ * partly read, with the rest left in the pool's lazy map.
+ */
+Node*
+loadfd(int fd, Nodepool *pool, int lazy)
+{
+	Biobuf bio;
+	uchar *buf;
+	Node *node;
+	int c;
+	
+	buf = malloc(IOBUF);
+	if(buf == nil) {
+		werrstr("out of memory");
+		return nil;
 	}
 	
+	Binits(&bio, fd, OREAD, buf, IOBUF);
+	
+	/* Text maps start with a NODE record, anything else must be binary */
+	c = Bgetc(&bio);
+	Bungetc(&bio);
+	if(c == Beof) {
+		werrstr("empty map");
+		node = nil;
+	} else if(c == 'N')
+		node = loadnode(&bio, pool, nil);
+	else
+		node = loadbin(&bio, pool, lazy);
+	Bterm(&bio);
+	free(buf);
+	
 	return node;
 }
 
-/* Save mind map to file */
-void
-savemap(char *filename)
+/*
+ * Read a map into pool from a file, or from the output of a command
+ * if cmd is set.  Returns nil with the error string set if it cannot.
+ */
+Node*
+readmap(char *name, int cmd, Nodepool *pool, int lazy)
 {
 	int fd;
+	Node *node;
+	
+	if(cmd) {
+		if((fd = pipeline("%s", name)) < 0) {
+			werrstr("pipeline failed: %r");
+			return nil;
+		}
+	} else if((fd = open(name, OREAD)) < 0) {
+		werrstr("open failed: %r");
+		return nil;
+	}
+	node = loadfd(fd, pool, lazy);
+	close(fd);
 	
-	if((fd = create(filename, OWRITE, 0666)) < 0)
-		sysfatal("create failed: %r");
+	return node;
+}
+
+/*
+ * Create the temp file a map is written to before it replaces the
+ * file name, setting *tmp to its name.  Returns -1 with the error
+ * string set if it cannot.
+ */
+int
+createtemp(char *name, char **tmp)
+{
+	int fd, there;
+	ulong perm;
+	Dir *d;
+	
+	/* Keep the permissions of the file being replaced */
+	perm = 0666;
+	there = (d = dirstat(name)) != nil;
+	if(there) {
+		perm = d->mode & 0777;
+		free(d);
+	}
 	
-	savenode(fd, root);
+	/* The temp file must live next to the target for the rename */
+	*tmp = smprint("%s.tmp", name);
+	if(*tmp == nil)
+		sysfatal("smprint failed: %r");
+	
+	/*
+	 * A temp file left beside the target is from a write that died
+	 * partway.  With the target gone it may be the only whole copy.
+	 */
+	if(access(*tmp, AEXIST) == 0) {
+		if(!there) {
+			werrstr("%s is there but %s is not", *tmp, name);
+			free(*tmp);
+			*tmp = nil;
+			return -1;
+		}
+		remove(*tmp);
+	}
+	if((fd = create(*tmp, OWRITE|OEXCL, perm)) < 0) {
+		werrstr("create failed: %r");
+		free(*tmp);
+		*tmp = nil;
+	}
+	return fd;
+}
+
+/*
+ * Write the map under root, held in pool, to fd and close it.  If
+ * tmp is set, fd is that temp file, which then replaces the file
+ * name once the map is complete.  Returns -1 with the error string
+ * set if it cannot.
+ */
+int
+writemap(int fd, char *tmp, char *name, Nodepool *pool, Node *root, int binary)
+{
+	if(savefd(fd, pool, root, binary) < 0) {
+		werrstr("write failed: %r");
+		close(fd);
+		if(tmp != nil)
+			remove(tmp);
+		return -1;
+	}
 	close(fd);
+	
+	if(tmp == nil)
+		return 0;
+	return replacefile(tmp, name);
 }
 
-/* Load mind map from file */
-void
-loadmap(char *filename)
+/* Put the complete file tmp, which lives next to name, in its place */
+int
+replacefile(char *tmp, char *name)
 {
-	int fd;
-	Node *newroot;
+	char *base;
+	Dir *d, nd;
+	
+	/*
+	 * wstat will not rename onto an existing file, so the old
+	 * one goes first; should we fail in between, the new one is
+	 * still intact in the temp file.
+	 */
+	if((d = dirstat(name)) != nil) {
+		free(d);
+		if(remove(name) < 0) {
+			werrstr("remove failed: %r");
+			return -1;
+		}
+	}
 	
-	if((fd = open(filename, OREAD)) < 0)
-		sysfatal("open failed: %r");
+	base = utfrrune(name, '/');
+	base = base != nil ? base+1 : name;
+	nulldir(&nd);
+	nd.name = base;
+	if(dirwstat(tmp, &nd) < 0) {
+		werrstr("rename failed: %r");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the map under root into pool, to be written out while the
+ * map itself goes on being edited.  Parts of a lazy map not read
+ * in yet are shared rather than copied, and as they belong to the
+ * current map pool->lazy must be cleared before pool is released.
+ * Returns nil with the error string set if there is no memory for
+ * the copy.
+ */
+Node*
+copymap(Nodepool *pool, Node *root)
+{
+	Treewalk w;
+	Node *n, *c, *top, **path, **p;
+	int cap;
+	
+	cap = 64;
+	path = malloc(cap*sizeof(path[0]));
+	if(path == nil) {
+		werrstr("out of memory");
+		return nil;
+	}
+	top = nil;
+	walkstart(&w, root);
+	while((n = walkstep(&w)) != nil) {
+		if(w.leaving)
+			continue;
+		if(w.depth == cap) {
+			if((p = realloc(path, 2*cap*sizeof(path[0]))) == nil) {
+				werrstr("out of memory");
+				top = nil;
+				break;
+			}
+			path = p;
+			cap *= 2;
+		}
+		if((c = newnode(pool, n->text, w.depth == 0 ? nil : path[w.depth-1])) == nil) {
+			top = nil;
+			break;
+		}
+		c->pos = n->pos;
+		c->manual_pos = n->manual_pos;
+		c->stub = n->stub;
+		c->src = n->src;
+		path[w.depth] = c;
+		if(top == nil)
+			top = c;
+	}
+	free(path);
+	if(top != nil)
+		pool->lazy = nodepool->lazy;
 	
-	newroot = loadnode(fd, nil);
-	close(fd);
+	return top;
+}
+
+static void
+freejob(Job *j)
+{
+	if(j->pool != nil) {
+		if(j->writing)
+			j->pool->lazy = nil;  /* Shared with the current map */
+		poolrelease(j->pool);
+	}
+	free(j->tmp);
+	free(j->name);
+	free(j);
+}
+
+/* Run a job on a proc of its own, telling the main loop when it is done */
+static void
+jobproc(void *v)
+{
+	Job *j;
+	
+	j = v;
+	if(j->writing) {
+		if(writemap(j->fd, j->tmp, j->name, j->pool, j->root, j->binary) < 0)
+			rerrstr(j->err, sizeof(j->err));
+	} else {
+		if((j->root = readmap(j->name, j->cmd, j->pool, lazyload)) == nil)
+			rerrstr(j->err, sizeof(j->err));
+	}
+	write(jobpipe[1], "j", 1);
+}
+
+/*
+ * Read or write a map in the background, unless a job is already
+ * under way.  What a write goes to is opened here, so that any
+ * error comes out at once.
+ */
+static void
+startjob(char *name, int cmd, int writing, int binary)
+{
+	Job *j;
+	Dir *d;
+	
+	if(job != nil) {
+		snprint(jobmsg, sizeof(jobmsg), "busy %s %s",
+			job->writing ? "writing" : "reading", job->name);
+		return;
+	}
+	
+	j = mallocz(sizeof(Job), 1);
+	if(j == nil || (j->name = strdup(name)) == nil)
+		sysfatal("malloc failed: %r");
+	j->cmd = cmd;
+	j->writing = writing;
+	j->binary = binary;
+	if(writing) {
+		if(cmd && (j->fd = pipeline("%s", name)) < 0)
+			werrstr("pipeline failed: %r");
+		else if(!cmd)
+			j->fd = createtemp(name, &j->tmp);
+		if(j->fd < 0) {
+			snprint(jobmsg, sizeof(jobmsg), "%s: %r", name);
+			freejob(j);
+			return;
+		}
+		
+		/* Taken now, as the proc closes fd once it is done */
+		if(j->tmp != nil) {
+			if((d = dirfstat(j->fd)) == nil) {
+				snprint(jobmsg, sizeof(jobmsg), "%s: %r", j->tmp);
+				close(j->fd);
+				remove(j->tmp);
+				freejob(j);
+				return;
+			}
+			j->path = d->qid.path;
+			free(d);
+		}
+	}
+	if((j->pool = poolcreate()) == nil
+	|| (writing && (j->root = copymap(j->pool, root)) == nil)) {
+		snprint(jobmsg, sizeof(jobmsg), "%s: %r", name);
+		if(writing) {
+			close(j->fd);
+			if(j->tmp != nil)
+				remove(j->tmp);
+		}
+		freejob(j);
+		return;
+	}
+	
+	job = j;
+	if(newproc(jobproc, j) < 0) {
+		job = nil;
+		snprint(jobmsg, sizeof(jobmsg), "%s: %r", name);
+		if(writing) {
+			close(j->fd);
+			if(j->tmp != nil)
+				remove(j->tmp);
+		}
+		freejob(j);
+	}
+}
+
+/* Save the map to a file, or to a command if cmd is set */
+void
+savemap(char *name, int cmd, int binary)
+{
+	startjob(name, cmd, 1, binary || (!cmd && binaryname(name)));
+}
+
+/*
+ * Write the map out to the file it is journaled in, in binary form
+ * if binary is set, setting *path
+ * to the qid.path the file will have.  Returns -1 if it cannot
+ * start, as while another job is under way.
+ */
+int
+snapshotmap(char *name, int binary, uvlong *path)
+{
+	if(job != nil) {
+		werrstr("busy %s %s", job->writing ? "writing" : "reading", job->name);
+		return -1;
+	}
+	startjob(name, 0, 1, binary);
+	if(job == nil) {
+		werrstr("%s", jobmsg);
+		return -1;
+	}
+	job->snapshot = 1;
+	*path = job->path;  /* The rename keeps the temp file's qid */
+	return 0;
+}
+
+/* Load a map from a file, or from a command if cmd is set */
+void
+loadmap(char *name, int cmd)
+{
+	startjob(name, cmd, 0, 0);
+}
+
+/* Take in the outcome of the job just done */
+void
+finishjob(void)
+{
+	Job *j;
+	int ok;
 	
-	if(newroot == nil)
-		sysfatal("invalid file format");
+	if((j = job) == nil)
+		return;
+	job = nil;
+	
+	ok = j->err[0] == '\0';
+	if(!ok)
+		snprint(jobmsg, sizeof(jobmsg), "%s: %s", j->name, j->err);
+	else if(j->writing)
+		snprint(jobmsg, sizeof(jobmsg), "wrote %s", j->name);
+	else {
+		/* The new map takes over in one step */
+		if(mode == INSERT || mode == DRAGGING)
+			switchmode(NORMAL);
+		replacemap(j->root, j->pool);
+		j->pool = nil;
+		damageall();
+		snprint(jobmsg, sizeof(jobmsg), "read %s", j->name);
+	}
+	
+	if(j->snapshot)
+		journalcommit(ok);
+	else if(!j->writing && journaling)
+		journalread(j->name, ok);
+	freejob(j);
+}
+
+/* Put news in the status line until the next command */
+void
+setstatus(char *fmt, ...)
+{
+	va_list a;
 	
-	/* Replace existing tree */
-	if(root != nil)
-		deletenode(root);
+	va_start(a, fmt);
+	vsnprint(jobmsg, sizeof(jobmsg), fmt, a);
+	va_end(a);
+}
+
+/* Make a freshly loaded tree the current map, dropping the old one whole */
+void
+replacemap(Node *newroot, Nodepool *pool)
+{
+	/* Replace existing tree, and the edits to it with it */
+	histclear();
+	poolrelease(nodepool);
+	nodepool = pool;
 	root = newroot;
 	current = root;
+	layoutreset();
 	
-	/* Update layout */
-	layoutmap(root, 0);
-	drawmap();
+	/* Lay out the new map now; the main loop draws it */
+	center_tree_auto(root, MARGIN);
 }
 
 /* Handle file operations */
@@ -839,13 +1946,22 @@ void
 handlecmd(char *cmd)
 {
 	char *s;
-	int fd;
-	Node *newroot;
+	int binary;
 	
 	s = cmd+1;
 	while(*s == ' ' || *s == '\t')
 		s++;
 	
+	/* Writes take -b to select the binary format; reads detect it */
+	binary = 0;
+	if(s[0] == '-' && s[1] == 'b' && (s[2] == ' ' || s[2] == '\t')) {
+		binary = 1;
+		s += 3;
+		while(*s == ' ' || *s == '\t')
+			s++;
+	}
+	
+	jobmsg[0] = '\0';
 	switch(cmd[0]) {
 	case 'q':  /* quit */
 		exits(nil);
@@ -853,36 +1969,25 @@ handlecmd(char *cmd)
 	case 'r':  /* read file */
 		if(*s == 0)
 			break;
-		loadmap(s);
+		loadmap(s, 0);
 		break;
 	case 'w':  /* write file */
 		if(*s == 0)
 			break;
-		savemap(s);
+		if(!journaled(s))
+			savemap(s, 0, binary);
+		else if(journalcompact(0, binary || binaryname(s)) < 0)  /* Its journal must hear of it */
+			setstatus("%s: %r", s);
 		break;
 	case '<':  /* read from command */
 		if(*s == 0)
 			break;
-		if((fd = pipeline("%s", s)) < 0)
-			sysfatal("pipeline failed: %r");
-		newroot = loadnode(fd, nil);
-		close(fd);
-		if(newroot == nil)
-			sysfatal("invalid file format");
-		if(root != nil)
-			deletenode(root);
-		root = newroot;
-		current = root;
-		layoutmap(root, 0);
-		drawmap();
+		loadmap(s, 1);
 		break;
 	case '>':  /* write to command */
 		if(*s == 0)
 			break;
-		if((fd = pipeline("%s", s)) < 0)
-			sysfatal("pipeline failed: %r");
-		savenode(fd, root);
-		close(fd);
+		savemap(s, 1, binary);
 		break;
 	}
 }
@@ -919,6 +2024,145 @@ pipeline(char *fmt, ...)
 	return p[1];
 }
 
+/* Act on the mouse */
+void
+handlemouse(Mouse m)
+{
+	Node *hit;
+	
+	/* The wheel zooms about the pointer */
+	if(m.buttons & 8) {
+		setzoom(zoom - 1, m.xy);
+		return;
+	}
+	if(m.buttons & 16) {
+		setzoom(zoom + 1, m.xy);
+		return;
+	}
+	
+	if(m.buttons & 1) {  /* Left button */
+		if(mode != DRAGGING && mode != CANVAS_DRAG) {
+			hit = findnode(root, m.xy);
+			if(hit != nil) {
+				damage(current->bounds);
+				damage(hit->bounds);
+				current = hit;
+				switchmode(DRAGGING);
+				histgrab(hit);
+				/* Calculate drag offset in absolute coordinates */
+				drag_offset = subpt(hit->pos, tomap(m.xy));
+			} else {
+				/* Start canvas drag mode */
+				switchmode(CANVAS_DRAG);
+				panning = 1;
+				pan_start = m.xy;
+			}
+		} else if(mode == DRAGGING) {
+			updatedrag(current, m.xy);
+		} else if(mode == CANVAS_DRAG) {
+			/* Update viewport position */
+			scrollmap(subpt(pan_start, m.xy));
+			pan_start = m.xy;
+		}
+	} else {
+		if(mode == DRAGGING) {
+			switchmode(NORMAL);
+			if(histmove(current))
+				journalmove(current);
+		} else if(mode == CANVAS_DRAG) {
+			/* Exit canvas drag mode on mouse up if we were panning */
+			if(panning) {
+				panning = 0;
+				switchmode(NORMAL);
+			}
+		}
+	}
+}
+
+/*
+ * Act on an event.  Of a run of mouse events that only move the
+ * pointer, with the buttons held as they were, just the last is
+ * acted on, so a drag jumps straight to where the pointer is now
+ * rather than working through where it has been.
+ */
+void
+applyevent(int e, Event *ev)
+{
+	Mouse m;
+	
+	switch(e) {
+	case Emouse:
+		while(!ecankbd() && ecanmouse()) {
+			m = emouse();
+			if(m.buttons != ev->mouse.buttons
+			|| (m.buttons != 0 && mode != DRAGGING && mode != CANVAS_DRAG))
+				handlemouse(ev->mouse);
+			ev->mouse = m;
+		}
+		handlemouse(ev->mouse);
+		break;
+	case Ekeyboard:
+		handlekey(ev->kbdc, ev);
+		break;
+	default:
+		/* A tick only has the status line brought up to date */
+		if(e == Ejob)
+			finishjob();
+		break;
+	}
+}
+
+/* Act on every event already waiting */
+void
+drainevents(void)
+{
+	Event ev;
+	
+	while(ecanread(Emouse|Ekeyboard|Ejob))
+		applyevent(event(&ev), &ev);
+}
+
+/*
+ * Hold the next frame back until a frame's time has passed since
+ * the last, if maxfps is set and there is anything to draw.
+ * Returns whether it waited, in which case more events may be in.
+ */
+int
+pace(void)
+{
+	static vlong last;
+	vlong now, next;
+	int waited;
+	
+	waited = 0;
+	if(maxfps > 0 && (ndamaged > 0 || fulldamage || scrolled)) {
+		now = nsec();
+		next = last + 1000000000LL/maxfps;
+		if(now < next) {
+			sleep((next - now)/1000000);
+			waited = 1;
+		}
+		last = nsec();
+	}
+	return waited;
+}
+
+/* Start a proc sharing our memory to run f(arg), which exits when f returns */
+int
+newproc(void (*f)(void*), void *arg)
+{
+	int pid;
+	
+	switch(pid = rfork(RFPROC|RFMEM|RFNOWAIT)){
+	case -1:
+		return -1;
+	case 0:
+		f(arg);
+		_exits(nil);
+	}
+	return pid;
+}
+
 void
 main(int argc, char *argv[])
 {
@@ -926,12 +2170,38 @@ main(int argc, char *argv[])
 	int e;
 
 	ARGBEGIN{
+	case 'l':
+		lazyload = 1;
+		break;
+	case 'c':
+		cachebudget = atol(EARGF(usage()))*1024;
+		break;
+	case 'f':
+		maxfps = atoi(EARGF(usage()));
+		break;
+	case 's':
+		showstats = 1;
+		break;
+	case 'j':
+		journaling = 1;
+		break;
+	case 'u':
+		histbudget = atol(EARGF(usage()))*1024;
+		break;
 	default:
 		usage();
 	}ARGEND
 
 	if(argc > 1)
 		usage();
+	
+	/* A journal goes with a map file, and is played over all of it */
+	if(journaling) {
+		if(argc != 1)
+			usage();
+		journalinit(argv[0]);
+		lazyload = 0;
+	}
 
 	/* Initialize display first */
 	if(initdraw(nil, nil, "mindthemap") < 0)
@@ -947,66 +2217,33 @@ main(int argc, char *argv[])
 	if(getwindow(display, Refnone) < 0)
 		sysfatal("getwindow failed: %r");
 	
-	/* Now create initial map */
-	if(argc == 1) {
-		loadmap(argv[0]);
-	} else {
-		initmap();
-	}
+	/* Jobs report back through a pipe, and on their progress by a timer */
+	if(pipe(jobpipe) < 0)
+		sysfatal("pipe failed: %r");
+	Ejob = estart(0, jobpipe[0], 1);
+	Etick = etimer(0, JOBTICK);
+	
+	/* Now create initial map, shown while any file is read in */
+	initmap();
+	if(argc == 1)
+		loadmap(argv[0], 0);
 	
 	/* First draw after window is properly sized */
 	drawmap();
 	
-	/* Main event loop */
+	/* Main event loop: take in everything waiting, then draw one frame */
 	for(;;) {
 		e = event(&ev);
-		switch(e) {
-		case Emouse:
-			if(ev.mouse.buttons & 1) {  /* Left button */
-				if(mode != DRAGGING && mode != CANVAS_DRAG) {
-					Node *hit = findnode(root, ev.mouse.xy);
-					if(hit != nil) {
-						current = hit;
-						mode = DRAGGING;
-						/* Calculate drag offset in absolute coordinates */
-						hit->drag_offset = subpt(hit->pos, addpt(ev.mouse.xy, viewport));
-						drawmap();
-					} else {
-						/* Start canvas drag mode */
-						switchmode(CANVAS_DRAG);
-						panning = 1;
-						pan_start = ev.mouse.xy;
-						drawmap();
-					}
-				} else if(mode == DRAGGING) {
-					updatedrag(current, ev.mouse.xy);
-					drawmap();
-				} else if(mode == CANVAS_DRAG) {
-					/* Update viewport position */
-					viewport.x += pan_start.x - ev.mouse.xy.x;
-					viewport.y += pan_start.y - ev.mouse.xy.y;
-					pan_start = ev.mouse.xy;
-					drawmap();
-				}
-			} else {
-				if(mode == DRAGGING) {
-					mode = NORMAL;
-					drawmap();
-				} else if(mode == CANVAS_DRAG) {
-					/* Exit canvas drag mode on mouse up if we were panning */
-					if(panning) {
-						panning = 0;
-						switchmode(NORMAL);
-						drawmap();
-					}
-				}
-			}
-			break;
-		case Ekeyboard:
-			handlekey(ev.kbdc, &ev);
-			drawmap();
-			break;
-		}
+		
+		/* libevent timers cannot be stopped, so ticks with no job are ignored */
+		if(e == Etick && job == nil)
+			continue;
+		applyevent(e, &ev);
+		drainevents();
+		if(pace())
+			drainevents();
+		journalcheck();
+		drawmap();
 	}
 	
 	exits(nil);  /* Normal exit */
@@ -7,13 +7,26 @@
 #include <event.h>
 #include <keyboard.h>
 #include <thread.h>
+#include <bio.h>
 
-/* Maximum number of children per node */
-#define MAXCHILDREN 32
-
-/* Maximum length of node text */
+/* Maximum length of node text typed in */
 #define MAXTEXT 256
 
+/* Size of the buffer used for reading and writing maps */
+#define IOBUF (64*1024)
+
+/* Layout and drawing metrics */
+enum {
+	MARGIN = 30,      /* Reduced margin for better use of space */
+	HSPACE = 80,      /* Reduced horizontal space between nodes */
+	VSPACE = 50,      /* Reduced vertical space between nodes */
+	MINW = 100,       /* Reduced minimum node width */
+	NODEH = 30,       /* Reduced node height */
+	PADDING = 10,     /* Reduced text padding inside nodes */
+	CORNER = 8,       /* Corner sprite size, and the radius of node corners */
+	CONN = 4          /* Connection point sprite size */
+};
+
 /* Application modes */
 enum {
 	NORMAL = 0,
@@ -24,17 +37,130 @@ enum {
 
 /* Node structure */
 typedef struct Node {
-	char text[MAXTEXT];
+	char *text;      /* Kept in the pool's text arena */
+	int textcap;     /* Bytes writable at text, 0 if shared */
+	int width;       /* nodewidth of text, 0 until measured */
 	Point pos;
 	Rectangle bounds;
 	struct Node *parent;
-	struct Node *children[MAXCHILDREN];
+	struct Node *child;  /* First child */
+	struct Node *last;   /* Last child */
+	struct Node *next;   /* Next sibling */
+	struct Node *prev;   /* Previous sibling */
 	int nchildren;
-	int manual_pos;  /* Flag to indicate manual positioning */
-	Point drag_offset;  /* Offset from mouse position during drag */
-	int selected;    /* Flag to indicate node selection state */
+	ulong src;       /* Record of this node in the lazy map */
+	ulong id;        /* Names the node in the journal */
+	int idx;         /* Position in the tree store */
+	uchar manual_pos;  /* Flag to indicate manual positioning */
+	uchar selected;  /* Flag to indicate node selection state */
+	uchar stub;      /* Children not read in from the lazy map yet */
+	uchar dirty;     /* New or retexted since the last layout */
 } Node;
 
+/*
+ * The map flattened into preorder arrays, indexed by Node.idx.
+ * The subtree under node i is the range [i, end[i]).
+ */
+typedef struct Grident Grident;
+typedef struct Tree {
+	Node **node;
+	int *depth;
+	int *parent;     /* -1 for the root */
+	int *end;
+	Rectangle *bounds;
+	Rectangle *span;     /* Union of the bounds over the subtree */
+	int n;
+	int cap;
+	int reshaped;    /* Changed shape since the last layout */
+	int valid;       /* Matches the node graph */
+	int *bucket;     /* Grid over the bounds, for hit testing */
+	int nbucket;     /* A power of two */
+	Grident *grid;
+	int nent;
+	int entcap;
+	int gridfree;    /* Free list through Grident.next */
+	int gridvalid;   /* Matches the bounds */
+} Tree;
+
+/* Where a walk over a subtree by its links has got to */
+typedef struct Treewalk {
+	Node *top;
+	Node *n;         /* Node last entered or left, nil before and after */
+	int depth;       /* Of n below top */
+	int leaving;     /* n was left rather than entered */
+} Treewalk;
+
+/* Where a tidy tree layout has got to with one node */
+typedef struct Place {
+	Node *node;
+	int parent;      /* -1 for the node laid out */
+	int first;       /* Automatically placed children, -1 if none */
+	int last;
+	int prev;        /* Siblings among them */
+	int next;
+	int number;      /* Position among the siblings, from 1 */
+	int top;         /* Node heading the tidy tree this one is in */
+	int depth;       /* Below top */
+	int levels;      /* For a head, depths in its tree */
+	int col;         /* For a head, its tree's first column */
+	int end;         /* Just past the node's last descendant */
+	int task;        /* Walked below on its own, maybe by another proc */
+	int thread;      /* Next node along the contour, if not a child */
+	int ancestor;
+	int dflt;        /* Default ancestor while placing the children */
+	int rel;         /* Offset below the parent, for moving with it */
+	double prelim;
+	double mod;
+	double shift;
+	double change;
+} Place;
+
+/* State of one layout pass, and of the edits awaiting the next */
+typedef struct Layout {
+	int xpos;
+	int ypos;        /* Top of the tree */
+	int maxwidth;
+	Place *place;    /* The tree in preorder */
+	int n;
+	int cap;
+	int all;         /* Lay out every node on the next pass */
+	int *colw;       /* Widest node in each column of each tidy tree */
+	int *colx;       /* Where each column starts, right of its head */
+	int ncol;
+	int colcap;
+	Node **dirty;    /* Nodes to place again on the next pass */
+	int ndirty;
+	int dirtycap;
+} Layout;
+
+/* Records of a binary map that are read in on demand */
+typedef struct Lazymap {
+	uchar *recs;
+	char *strs;
+	ulong nnodes;
+	ulong strsize;
+} Lazymap;
+
+/* Slab allocator holding all the memory behind one map */
+typedef struct Slab Slab;
+typedef struct Block Block;
+typedef struct Nodepool {
+	Slab *slabs;     /* Newest first */
+	int slabused;    /* Nodes handed out from the newest slab */
+	Node *freelist;  /* Deleted nodes, linked through parent */
+	Block *blocks;   /* Text arena and other memory owned by the map */
+	char *textp;     /* Free space in the newest text block */
+	int textleft;
+	Lazymap *lazy;   /* Unread part of the map, if any */
+	ulong nslabs;
+	ulong nused;     /* Nodes live in the map */
+	ulong nfree;     /* Nodes waiting on the free list */
+	ulong peak;      /* Most nodes live at once */
+	ulong nallocs;   /* Nodes handed out over the pool's life */
+	ulong nwritten;  /* Nodes written out by the save under way */
+	uvlong textbytes;  /* Bytes held in blocks */
+} Nodepool;
+
 /* Global variables */
 extern int mode;
 extern Node *root;
@@ -43,9 +169,20 @@ extern struct Image *screen;
 extern struct Font *font;
 extern struct Display *display;
 extern Rectangle maprect;
-extern Point viewport;  /* Current viewport offset for panning */
+extern Point viewport;  /* Current viewport offset for panning, in window pixels */
+extern int zoom;  /* The map is drawn at 1/(1<<zoom) of its size */
 extern Point pan_start;  /* Starting point for panning */
 extern int panning;  /* Flag to indicate if we're panning the viewport */
+extern Point drag_offset;  /* Offset from mouse position of the node being dragged */
+extern Nodepool *nodepool;  /* Memory behind the current map */
+extern int lazyload;  /* Read binary maps in on demand */
+extern int showstats;  /* Show allocation statistics in the status line */
+extern Tree tree;  /* Preorder arrays of the current map */
+extern Layout *maplayout;  /* Layout state of the current map */
+extern int maxfps;  /* Most frames drawn a second, 0 for no limit */
+extern long cachebudget;  /* Bytes of rendered node images to keep */
+extern int journaling;  /* Keep a journal of edits to the map file */
+extern long histbudget;  /* Bytes of undo history to keep */
 
 /* Rio-inspired colors */
 extern Image *back;    /* Background - pale yellow */
@@ -61,18 +198,52 @@ extern Image *pale;    /* Pale - light blue */
 void setupdraw(void);
 void initmap(void);
 void initcolors(void);
+void initsprites(void);
+int colorindex(Image *c);
 int nodewidth(char *text);
+int measurenode(Node *node);
+void flushwidths(void);
 void roundedrect(Image *dst, Rectangle r, Image *src, Point sp, int style);
-void drawconnection(Point from, Point to, int thickness, Image *color);
+void rendernode(Image *dst, Rectangle r, Image *bg, Image *fg, char *s);
+Image* nodeimage(char *s, int width, Image *bg, Image *fg);
+void nodeimageframe(void);
+void flushnodeimages(void);
 Node* createnode(char *text, Node *parent);
+Node* newnode(Nodepool *pool, char *text, Node *parent);
+void settext(Nodepool *pool, Node *node, char *text);
+void growtext(Nodepool *pool, Node *node, int n);
 void addchild(Node *parent);
 void deletenode(Node *node);
+void detachnode(Node *node);
+void attachnode(Node *node, Node *parent, Node *prev);
+void freenode(Node *node);
 void layoutmap(Node *node, int depth);
+void markdirty(Node *node);
+void layoutreset(void);
+void layoutreshape(void);
+Layout* layoutcreate(void);
+void layoutfree(Layout *l);
+void layouttree(Layout *l, Node *node, int depth);
+void layoutdirty(Layout *l, Node *node);
+void layoutupdate(Layout *l, Node *root);
 void drawmap(void);
+int drawstatus(Rectangle winr, int force);
+Point toscreen(Point p);
+Rectangle toscreenr(Rectangle r);
+Point tomap(Point p);
+void setzoom(int z, Point p);
+void damage(Rectangle r);
+void damageall(void);
+void damagetree(int i);
+void scrollmap(Point d);
 void drawnode(Node *node);
 void navigate(Rune key);
 void switchmode(int newmode);
 void handlekey(Rune key, Event *ev);
+void handlemouse(Mouse m);
+void applyevent(int e, Event *ev);
+void drainevents(void);
+int pace(void);
 void resdraw(void);
 void eresized(int new);
 void usage(void);
@@ -82,11 +253,78 @@ Point snaptoGrid(Point p);
 void updatedrag(Node *node, Point mouse);
 
 /* File operations */
-void savenode(int fd, Node *node);
-Node* loadnode(int fd, Node *parent);
-void savemap(char *filename);
-void loadmap(char *filename);
+int savenode(Biobuf *bp, Nodepool *pool, Node *node);
+int savefd(int fd, Nodepool *pool, Node *node, int binary);
+Node* loadnode(Biobuf *bp, Nodepool *pool, Node *parent);
+Node* loadfd(int fd, Nodepool *pool, int lazy);
+Node* readmap(char *name, int cmd, Nodepool *pool, int lazy);
+int createtemp(char *name, char **tmp);
+int writemap(int fd, char *tmp, char *name, Nodepool *pool, Node *root, int binary);
+Node* copymap(Nodepool *pool, Node *root);
+void savemap(char *name, int cmd, int binary);
+void loadmap(char *name, int cmd);
+void finishjob(void);
+int snapshotmap(char *name, int binary, uvlong *path);
+int replacefile(char *tmp, char *name);
+void setstatus(char *fmt, ...);
+void replacemap(Node *newroot, Nodepool *pool);
 void handlecmd(char *cmd);
 int pipeline(char *fmt, ...);
+int newproc(void (*f)(void*), void *arg);
+
+/* Binary map format */
+int savebin(Biobuf *bp, Nodepool *pool, Node *root);
+Node* loadbin(Biobuf *bp, Nodepool *pool, int lazy);
+int binaryname(char *filename);
+
+/* Lazy loading */
+int nodechildren(Nodepool *pool, Node *node);
+int savestub(Biobuf *bp, Nodepool *pool, Node *node);
+void expandnode(Node *node);
+void freelazy(Lazymap *lm);
+
+/* Journal */
+void journalinit(char *name);
+int journaled(char *name);
+void journaladd(Node *n);
+void journaldel(Node *n);
+void journaltext(Node *n);
+void journalmove(Node *n);
+void journalrestore(Node *n, ulong gen);
+ulong journalgen(void);
+void journalread(char *name, int ok);
+int journalcompact(int replaced, int binary);
+void journalcheck(void);
+void journalcommit(int ok);
+
+/* Undo history */
+void histadd(Node *n);
+void histdelete(Node *n);
+void histtext(Node *n);
+void histtextdone(void);
+void histgrab(Node *n);
+int histmove(Node *n);
+int undo(void);
+int redo(void);
+void histclear(void);
+
+/* Node pools */
+Nodepool* poolcreate(void);
+Node* poolalloc(Nodepool *p);
+void poolfree(Nodepool *p, Node *n);
+void poolrelease(Nodepool *p);
+char* pooltext(Nodepool *p, int n);
+int poolattach(Nodepool *p, void *v);
+char* poolstats(Nodepool *p, char *buf, int n);
+
+/* Tree store */
+void walkstart(Treewalk *w, Node *top);
+Node* walkstep(Treewalk *w);
+void treestale(void);
+void treeupdate(Node *root);
+void setbounds(Node *node, Rectangle r);
+void treebounds(void);
+void treespans(int s);
+Node* treefind(Point p, int lo, int hi);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include "mindthemap.h"
+
+/*
+ * Cache of rendered nodes.  Each node's box and text are drawn once
+ * into an image of their own, with a clear background around the
+ * corners, and drawing the node after that is a single draw of the
+ * image.  Entries are found by the node's text, width and color,
+ * so editing a node or moving the selection on or off it simply
+ * asks for a different entry; the old one is never asked for again
+ * and ages out.  The least recently drawn entries are freed while
+ * the images together take more than cachebudget bytes, but never
+ * one drawn in the frame under way: when more nodes are in view
+ * than fit, the rest are drawn directly rather than each evicting
+ * another that the next frame will want again.
+ */
+enum {
+	NHASH = 1024  /* Hash chains */
+};
+
+typedef struct Cached Cached;
+struct Cached {
+	char *text;     /* Copy of the node's text */
+	int width;
+	int color;      /* colorindex of the background */
+	Image *img;
+	long bytes;
+	ulong frame;    /* Last drawn in */
+	Cached *hnext;  /* In the hash chain */
+	Cached *prev;   /* In the recency list, most recent first */
+	Cached *next;
+};
+
+long cachebudget = 8*1024*1024;  /* Bytes of node images to keep */
+
+static Cached *hash[NHASH];
+static Cached *newest;
+static Cached *oldest;
+static long cachebytes;
+static ulong frame;
+
+static uint
+hashkey(char *text, int width, int color)
+{
+	uint h;
+
+	h = width*31 + color;
+	while(*text)
+		h = h*33 + (uchar)*text++;
+	return h % NHASH;
+}
+
+static void
+lrudel(Cached *c)
+{
+	if(c->prev != nil)
+		c->prev->next = c->next;
+	else
+		newest = c->next;
+	if(c->next != nil)
+		c->next->prev = c->prev;
+	else
+		oldest = c->prev;
+}
+
+static void
+lruadd(Cached *c)
+{
+	c->prev = nil;
+	c->next = newest;
+	if(newest != nil)
+		newest->prev = c;
+	else
+		oldest = c;
+	newest = c;
+}
+
+/* Free the least recently drawn entry */
+static void
+evict(void)
+{
+	Cached *c, **cp;
+
+	c = oldest;
+	lrudel(c);
+	for(cp = &hash[hashkey(c->text, c->width, c->color)]; *cp != c; cp = &(*cp)->hnext)
+		;
+	*cp = c->hnext;
+	cachebytes -= c->bytes;
+	freeimage(c->img);
+	free(c->text);
+	free(c);
+}
+
+/* Draw a node's box and text at r in dst */
+void
+rendernode(Image *dst, Rectangle r, Image *bg, Image *fg, char *s)
+{
+	Point txtp;
+
+	roundedrect(dst, r, bg, ZP, 0);
+
+	/* Draw node text if there's room */
+	if(r.max.x - r.min.x > 2*PADDING) {
+		txtp.x = r.min.x + PADDING;
+		txtp.y = r.min.y + (NODEH - font->height) / 2;
+		string(dst, txtp, fg, ZP, font, s);
+	}
+}
+
+/*
+ * The rendered image of a node width wide showing s in fg on bg,
+ * or nil if it is too big to keep or there is no memory for it
+ * here or in the display, in which case the caller should draw
+ * the node itself.
+ */
+Image*
+nodeimage(char *s, int width, Image *bg, Image *fg)
+{
+	Cached *c;
+	Rectangle r;
+	uint h;
+	int color;
+	long bytes;
+
+	color = colorindex(bg);
+	h = hashkey(s, width, color);
+	for(c = hash[h]; c != nil; c = c->hnext)
+		if(c->width == width && c->color == color && strcmp(c->text, s) == 0) {
+			lrudel(c);
+			lruadd(c);
+			c->frame = frame;
+			return c->img;
+		}
+
+	bytes = (long)width*NODEH*4;
+	if(bytes > cachebudget)
+		return nil;
+	while(cachebytes + bytes > cachebudget) {
+		if(oldest->frame == frame)
+			return nil;
+		evict();
+	}
+
+	c = malloc(sizeof(Cached));
+	if(c == nil)
+		return nil;
+	r = Rect(0, 0, width, NODEH);
+	c->img = allocimage(display, r, RGBA32, 0, DTransparent);
+	c->text = strdup(s);
+	if(c->img == nil || c->text == nil) {
+		if(c->img != nil)
+			freeimage(c->img);
+		free(c->text);
+		free(c);
+		return nil;
+	}
+	rendernode(c->img, r, bg, fg, s);
+	c->width = width;
+	c->color = color;
+	c->bytes = bytes;
+	c->frame = frame;
+	c->hnext = hash[h];
+	hash[h] = c;
+	lruadd(c);
+	cachebytes += bytes;
+	return c->img;
+}
+
+/* Note that a new frame is being drawn */
+void
+nodeimageframe(void)
+{
+	frame++;
+}
+
+/* Free every rendered node, as when the font or colors change */
+void
+flushnodeimages(void)
+{
+	while(oldest != nil)
+		evict();
+}
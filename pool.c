@@ -0,0 +1,180 @@
+#include "mindthemap.h"
+
+/*
+ * Every map gets a Nodepool of its own.  Nodes are carved out of
+ * large slabs, single deletes go back on a free list for reuse,
+ * and replacing the map releases the whole pool at once: one free
+ * per slab rather than a walk over the tree and a free per node.
+ * Node text is packed into blocks the same way; text that outgrows
+ * its space is simply abandoned until the pool goes.
+ *
+ * Maps are read and written on a proc of their own, which must
+ * not die over a map too big to hold, so running out of memory
+ * here sets the error string and hands back nil or -1.  What was
+ * built so far stays in the pool, to go when it is released.
+ */
+enum {
+	SLABNODES = 1024,      /* Nodes per slab */
+	TEXTBLOCK = 64*1024    /* Bytes per text block */
+};
+
+struct Slab {
+	Slab *next;
+	Node nodes[SLABNODES];
+};
+
+struct Block {
+	Block *next;
+	void *data;  /* Follows the Block itself unless attached */
+};
+
+/* Make an empty pool */
+Nodepool*
+poolcreate(void)
+{
+	Nodepool *p;
+
+	p = mallocz(sizeof(Nodepool), 1);
+	if(p == nil)
+		werrstr("out of memory");
+	return p;
+}
+
+/* Hand out a cleared node, from the free list if there is one */
+Node*
+poolalloc(Nodepool *p)
+{
+	Slab *s;
+	Node *n;
+
+	if((n = p->freelist) != nil) {
+		p->freelist = n->parent;
+		p->nfree--;
+	} else {
+		if(p->slabs == nil || p->slabused == SLABNODES) {
+			s = malloc(sizeof(Slab));
+			if(s == nil) {
+				werrstr("out of memory");
+				return nil;
+			}
+			s->next = p->slabs;
+			p->slabs = s;
+			p->slabused = 0;
+			p->nslabs++;
+		}
+		n = &p->slabs->nodes[p->slabused++];
+	}
+
+	p->nused++;
+	if(p->nused > p->peak)
+		p->peak = p->nused;
+	p->nallocs++;
+
+	memset(n, 0, sizeof(Node));
+	return n;
+}
+
+/* Put a single node back on the free list */
+void
+poolfree(Nodepool *p, Node *n)
+{
+	n->parent = p->freelist;
+	p->freelist = n;
+	p->nfree++;
+	p->nused--;
+}
+
+/* Release a pool along with every node and lazy record it holds */
+void
+poolrelease(Nodepool *p)
+{
+	Slab *s, *next;
+	Block *b, *bnext;
+
+	if(p == nil)
+		return;
+
+	for(s = p->slabs; s != nil; s = next) {
+		next = s->next;
+		free(s);
+	}
+	for(b = p->blocks; b != nil; b = bnext) {
+		bnext = b->next;
+		if(b->data != b+1)
+			free(b->data);
+		free(b);
+	}
+	freelazy(p->lazy);
+	free(p);
+}
+
+/* Add a block of n bytes to the pool */
+static Block*
+newblock(Nodepool *p, long n)
+{
+	Block *b;
+
+	b = malloc(sizeof(Block) + n);
+	if(b == nil) {
+		werrstr("out of memory");
+		return nil;
+	}
+	b->data = b+1;
+	b->next = p->blocks;
+	p->blocks = b;
+	p->textbytes += n;
+	return b;
+}
+
+/* Find n bytes of text space */
+char*
+pooltext(Nodepool *p, int n)
+{
+	Block *b;
+	char *s;
+
+	/* Big strings get a block to themselves and leave the current one be */
+	if(n > TEXTBLOCK/4) {
+		if((b = newblock(p, n)) == nil)
+			return nil;
+		return b->data;
+	}
+
+	if(n > p->textleft) {
+		if((b = newblock(p, TEXTBLOCK)) == nil)
+			return nil;
+		p->textp = b->data;
+		p->textleft = TEXTBLOCK;
+	}
+	s = p->textp;
+	p->textp += n;
+	p->textleft -= n;
+	return s;
+}
+
+/* Hand a malloced buffer over to the pool, to be freed along with it */
+int
+poolattach(Nodepool *p, void *v)
+{
+	Block *b;
+
+	b = malloc(sizeof(Block));
+	if(b == nil) {
+		werrstr("out of memory");
+		return -1;
+	}
+	b->data = v;
+	b->next = p->blocks;
+	p->blocks = b;
+	return 0;
+}
+
+/* Describe a pool's allocations */
+char*
+poolstats(Nodepool *p, char *buf, int n)
+{
+	snprint(buf, n, "%lud nodes (peak %lud), %lud free, %lud slabs, %lludK nodes, %lludK text",
+		p->nused, p->peak, p->nfree, p->nslabs,
+		(uvlong)p->nslabs*sizeof(Slab) / 1024, p->textbytes / 1024);
+	return buf;
+}
@@ -0,0 +1,320 @@
+#include "mindthemap.h"
+
+/*
+ * The tree store: the current map flattened into preorder arrays.
+ * The Node graph stays the thing that gets edited; whenever its
+ * shape changes the store is marked stale and rebuilt, in one walk
+ * down its links, before the next layout.  Layout, drawing, hit
+ * testing and saving then scan the arrays front to back instead of
+ * chasing pointers from node to node.  A subtree is the index range
+ * [i, end[i]), and tree.bounds mirrors each node's bounds.
+ * tree.span holds the union of the bounds over each subtree, so
+ * drawing can pass over whole subtrees that are out of view.
+ *
+ * Over the bounds lies a grid of CELL-sized squares, hashed into
+ * buckets, for finding the nodes under a point without scanning
+ * them all.  Each node is entered in every cell it touches.  The
+ * grid is built on demand after a full layout or a rebuild of the
+ * store, and setbounds keeps it in step as single nodes move.
+ */
+enum {
+	CELL = 256  /* Side of a grid cell */
+};
+
+struct Grident {
+	int x, y;    /* Cell */
+	int idx;     /* Node */
+	int next;    /* In the bucket, -1 at the end */
+};
+
+Tree tree;
+
+/*
+ * Walks over a subtree by the node links, shared by everything
+ * that has to go through a tree the store does not cover or while
+ * it is being built.  Each node is entered on the way down, in
+ * preorder, and left once all its descendants have been, in
+ * postorder, with w->depth following along.  The links lead back
+ * up, so deep maps need neither recursion nor a stack.
+ */
+void
+walkstart(Treewalk *w, Node *top)
+{
+	w->top = top;
+	w->n = nil;
+	w->depth = 0;
+	w->leaving = 0;
+}
+
+/* The next node entered or left, as w->leaving says, or nil at the end */
+Node*
+walkstep(Treewalk *w)
+{
+	Node *n;
+
+	n = w->n;
+	if(n == nil) {
+		if(w->top == nil || w->leaving)
+			return nil;
+		w->n = w->top;
+		return w->n;
+	}
+	if(!w->leaving) {
+		if(n->child != nil) {
+			w->depth++;
+			w->n = n->child;
+		} else
+			w->leaving = 1;
+		return w->n;
+	}
+	if(n == w->top) {
+		w->n = nil;
+		return nil;
+	}
+	if(n->next != nil) {
+		w->n = n->next;
+		w->leaving = 0;
+	} else {
+		w->depth--;
+		w->n = n->parent;
+	}
+	return w->n;
+}
+
+/* Note that the shape of the map has changed */
+void
+treestale(void)
+{
+	tree.valid = 0;
+}
+
+/* Make room for n nodes */
+static void
+treegrow(int n)
+{
+	if(n <= tree.cap)
+		return;
+
+	n += n/2;
+	tree.node = realloc(tree.node, n*sizeof(tree.node[0]));
+	tree.depth = realloc(tree.depth, n*sizeof(tree.depth[0]));
+	tree.parent = realloc(tree.parent, n*sizeof(tree.parent[0]));
+	tree.end = realloc(tree.end, n*sizeof(tree.end[0]));
+	tree.bounds = realloc(tree.bounds, n*sizeof(tree.bounds[0]));
+	tree.span = realloc(tree.span, n*sizeof(tree.span[0]));
+	if(tree.node == nil || tree.depth == nil || tree.parent == nil
+	|| tree.end == nil || tree.bounds == nil || tree.span == nil)
+		sysfatal("realloc failed: %r");
+	tree.cap = n;
+}
+
+/* Work out the spans under node s afresh, as after it has moved, and grow those above */
+void
+treespans(int s)
+{
+	int i, end;
+
+	end = tree.end[s];
+	for(i = s; i < end; i++)
+		tree.span[i] = tree.bounds[i];
+	for(i = end-1; i > s; i--)
+		combinerect(&tree.span[tree.parent[i]], tree.span[i]);
+	for(i = tree.parent[s]; i >= 0 && !rectinrect(tree.span[s], tree.span[i]); i = tree.parent[i])
+		combinerect(&tree.span[i], tree.span[s]);
+}
+
+/*
+ * Rebuild the store from the node graph if it has gone stale,
+ * noting in tree.reshaped whether nodes have come, gone or moved
+ * about, which the layout must hear of.
+ */
+void
+treeupdate(Node *root)
+{
+	Treewalk w;
+	Node *n;
+	int i, oldn;
+
+	if(tree.valid)
+		return;
+
+	oldn = tree.n;
+	tree.n = 0;
+	tree.valid = 1;
+	tree.gridvalid = 0;
+	if(root == nil)
+		return;
+
+	treegrow(nodepool->nused);
+	i = 0;
+	walkstart(&w, root);
+	while((n = walkstep(&w)) != nil) {
+		if(w.leaving) {
+			tree.end[n->idx] = i;
+			continue;
+		}
+		treegrow(i+1);
+		if(i >= oldn || tree.node[i] != n || n->dirty)
+			tree.reshaped = 1;
+		n->idx = i;
+		tree.node[i] = n;
+		tree.depth[i] = w.depth;
+		tree.parent[i] = n == root ? -1 : n->parent->idx;
+		tree.bounds[i] = n->bounds;
+		i++;
+	}
+	if(i != oldn)
+		tree.reshaped = 1;
+	tree.n = i;
+	treespans(0);
+}
+
+/* Cell holding coordinate v, rounding down */
+static int
+cellof(int v)
+{
+	return v >= 0 ? v/CELL : -((-v + CELL-1)/CELL);
+}
+
+static int
+bucket(int x, int y)
+{
+	return ((uint)x*0x9E3779B1 ^ (uint)y*0x85EBCA77) & (tree.nbucket-1);
+}
+
+/* Enter node i in every cell r touches */
+static void
+gridadd(int i, Rectangle r)
+{
+	Grident *e;
+	int x, y, b, k;
+
+	if(r.max.x <= r.min.x || r.max.y <= r.min.y)
+		return;
+	for(y = cellof(r.min.y); y <= cellof(r.max.y-1); y++)
+	for(x = cellof(r.min.x); x <= cellof(r.max.x-1); x++) {
+		if((k = tree.gridfree) >= 0)
+			tree.gridfree = tree.grid[k].next;
+		else {
+			if(tree.nent == tree.entcap) {
+				tree.entcap = tree.entcap ? 2*tree.entcap : 1024;
+				tree.grid = realloc(tree.grid, tree.entcap*sizeof(Grident));
+				if(tree.grid == nil)
+					sysfatal("realloc failed: %r");
+			}
+			k = tree.nent++;
+		}
+		e = &tree.grid[k];
+		b = bucket(x, y);
+		e->x = x;
+		e->y = y;
+		e->idx = i;
+		e->next = tree.bucket[b];
+		tree.bucket[b] = k;
+	}
+}
+
+/* Take node i out of the cells r touches */
+static void
+griddel(int i, Rectangle r)
+{
+	Grident *e;
+	int x, y, *kp;
+
+	if(r.max.x <= r.min.x || r.max.y <= r.min.y)
+		return;
+	for(y = cellof(r.min.y); y <= cellof(r.max.y-1); y++)
+	for(x = cellof(r.min.x); x <= cellof(r.max.x-1); x++)
+		for(kp = &tree.bucket[bucket(x, y)]; *kp >= 0; kp = &e->next) {
+			e = &tree.grid[*kp];
+			if(e->idx == i && e->x == x && e->y == y) {
+				*kp = e->next;
+				e->next = tree.gridfree;
+				tree.gridfree = e - tree.grid;
+				break;
+			}
+		}
+}
+
+/* Enter every node in a fresh grid */
+static void
+gridbuild(void)
+{
+	int i, n;
+
+	for(n = 1024; n < 2*tree.n; n *= 2)
+		;
+	if(n != tree.nbucket) {
+		free(tree.bucket);
+		tree.bucket = malloc(n*sizeof(tree.bucket[0]));
+		if(tree.bucket == nil)
+			sysfatal("malloc failed: %r");
+		tree.nbucket = n;
+	}
+	memset(tree.bucket, 0xFF, n*sizeof(tree.bucket[0]));  /* All -1 */
+	tree.nent = 0;
+	tree.gridfree = -1;
+	for(i = 0; i < tree.n; i++)
+		gridadd(i, tree.bounds[i]);
+	tree.gridvalid = 1;
+}
+
+/*
+ * Find the node under p among those in [lo, hi), taking the last
+ * in preorder where they overlap, so children win over parents
+ * and later siblings over earlier ones.
+ */
+Node*
+treefind(Point p, int lo, int hi)
+{
+	Grident *e;
+	int x, y, k, best;
+
+	if(!tree.gridvalid)
+		gridbuild();
+	x = cellof(p.x);
+	y = cellof(p.y);
+	best = -1;
+	for(k = tree.bucket[bucket(x, y)]; k >= 0; k = e->next) {
+		e = &tree.grid[k];
+		if(e->x == x && e->y == y && e->idx >= lo && e->idx < hi
+		&& e->idx > best && ptinrect(p, tree.bounds[e->idx]))
+			best = e->idx;
+	}
+	return best >= 0 ? tree.node[best] : nil;
+}
+
+/* Take every node's bounds into the store, as after a full layout */
+void
+treebounds(void)
+{
+	int i;
+
+	for(i = 0; i < tree.n; i++)
+		tree.bounds[i] = tree.node[i]->bounds;
+	tree.gridvalid = 0;
+	if(tree.n > 0)
+		treespans(0);
+}
+
+/*
+ * Move a node, keeping the store's copy of its bounds and the grid
+ * in step.  The spans above it grow to take it in but are left to
+ * shrink at the next full layout, which costs drawing only a little.
+ */
+void
+setbounds(Node *node, Rectangle r)
+{
+	int i;
+
+	node->bounds = r;
+	if(!tree.valid)
+		return;
+	if(tree.gridvalid) {
+		griddel(node->idx, tree.bounds[node->idx]);
+		gridadd(node->idx, r);
+	}
+	tree.bounds[node->idx] = r;
+	for(i = node->idx; i >= 0 && !rectinrect(r, tree.span[i]); i = tree.parent[i])
+		combinerect(&tree.span[i], r);
+}